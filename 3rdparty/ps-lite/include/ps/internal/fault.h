@@ -0,0 +1,201 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_FAULT_H_
+#define PS_INTERNAL_FAULT_H_
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "ps/base.h"
+namespace ps {
+
+/**
+ * \brief the loss and delay injected into the datagrams received on each udp
+ * channel, to benchmark DGT on a loopback network
+ *
+ * Every sender has its own generator on every channel, so that for a given
+ * seed the n-th datagram of a sender on a channel is always dropped or
+ * delayed the same way, however the senders and channels interleave.
+ * Delays are a fixed latency plus a uniform jitter.
+ */
+class FaultInjector {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  FaultInjector() { }
+
+  /**
+   * \brief set the number of channels, none of them faulty. not threadsafe,
+   * call it before the receiving threads start
+   */
+  void Resize(int num_channels) {
+    channels_.clear();
+    for (int i = 0; i < num_channels; ++i) channels_.emplace_back(new Channel());
+    Seed(0);
+  }
+
+  /** \brief restart every generator from \a seed. threadsafe */
+  void Seed(unsigned seed) {
+    for (auto& c : channels_) {
+      std::lock_guard<std::mutex> lk(c->mu);
+      c->seed = seed;
+      c->rng.clear();
+    }
+  }
+
+  /**
+   * \brief set the faults of a channel. not threadsafe
+   * \param drop the fraction of datagrams lost, in [0, 1]
+   * \param delay_us the latency added to every datagram
+   * \param jitter_us the most a datagram is delayed on top of it
+   */
+  void Set(int channel, double drop, int delay_us, int jitter_us) {
+    CHECK_LT(static_cast<size_t>(channel), channels_.size());
+    Channel* c = channels_[channel].get();
+    c->drop = std::min(1.0, std::max(0.0, drop));
+    c->delay_us = std::max(0, delay_us);
+    c->jitter_us = std::max(0, jitter_us);
+  }
+
+  /** \brief whether any channel drops datagrams */
+  bool drops() const {
+    for (const auto& c : channels_) {
+      if (c->drop > 0) return true;
+    }
+    return false;
+  }
+
+  /** \brief whether any channel delays datagrams */
+  bool delays() const {
+    for (const auto& c : channels_) {
+      if (c->delay_us > 0 || c->jitter_us > 0) return true;
+    }
+    return false;
+  }
+
+  /**
+   * \brief draw whether the datagram just received on \a channel from
+   * \a sender is lost, and if not, when it arrives. threadsafe
+   * \return true to drop the datagram
+   */
+  bool Draw(int channel, int sender, Clock::time_point* due) {
+    *due = Clock::now();
+    if (static_cast<size_t>(channel) >= channels_.size()) return false;
+    Channel* c = channels_[channel].get();
+    if (c->drop <= 0 && c->delay_us <= 0 && c->jitter_us <= 0) return false;
+    int jitter = 0;
+    {
+      std::lock_guard<std::mutex> lk(c->mu);
+      auto it = c->rng.find(sender);
+      if (it == c->rng.end()) {
+        std::seed_seq seq{c->seed, static_cast<unsigned>(channel), static_cast<unsigned>(sender)};
+        it = c->rng.emplace(sender, std::mt19937(seq)).first;
+      }
+      std::mt19937& rng = it->second;
+      if (c->drop > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < c->drop) {
+        ++c->dropped;
+        return true;
+      }
+      if (c->jitter_us > 0) jitter = std::uniform_int_distribution<int>(0, c->jitter_us)(rng);
+    }
+    *due += std::chrono::microseconds(c->delay_us + jitter);
+    return false;
+  }
+
+  /** \brief the datagrams dropped on each channel so far */
+  std::vector<size_t> dropped() const {
+    std::vector<size_t> n;
+    for (const auto& c : channels_) n.push_back(c->dropped.load());
+    return n;
+  }
+
+ private:
+  struct Channel {
+    double drop = 0;
+    int delay_us = 0;
+    int jitter_us = 0;
+    std::mutex mu;
+    unsigned seed = 0;
+    /** sender -> its generator */
+    std::unordered_map<int, std::mt19937> rng;
+    std::atomic<size_t> dropped{0};
+  };
+  std::vector<std::unique_ptr<Channel>> channels_;
+};
+
+/**
+ * \brief holds items until they are due, in the order they fall due
+ */
+template <typename T>
+class DelayLine {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  /** \brief hold \a item until \a due. threadsafe */
+  void Push(Clock::time_point due, T item) {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      items_.push(Item{due, seq_++, std::move(item)});
+    }
+    cond_.notify_one();
+  }
+
+  /**
+   * \brief wait for the next item to fall due
+   * \return false once stopped
+   */
+  bool Pop(T* item) {
+    std::unique_lock<std::mutex> lk(mu_);
+    while (!stop_) {
+      if (items_.empty()) {
+        cond_.wait(lk);
+        continue;
+      }
+      Clock::time_point due = items_.top().due;
+      if (Clock::now() < due) {
+        cond_.wait_until(lk, due);
+        continue;
+      }
+      *item = std::move(const_cast<Item&>(items_.top()).item);
+      items_.pop();
+      return true;
+    }
+    return false;
+  }
+
+  /** \brief wake up the popping thread for good, dropping what is held */
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      stop_ = true;
+      items_ = decltype(items_)();
+    }
+    cond_.notify_all();
+  }
+
+ private:
+  struct Item {
+    Clock::time_point due;
+    /** keeps the items due at the same time in order */
+    uint64_t seq;
+    T item;
+    bool operator<(const Item& other) const {
+      return due != other.due ? due > other.due : seq > other.seq;
+    }
+  };
+  std::priority_queue<Item> items_;
+  uint64_t seq_ = 0;
+  bool stop_ = false;
+  std::mutex mu_;
+  std::condition_variable cond_;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_FAULT_H_
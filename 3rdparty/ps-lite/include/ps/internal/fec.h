@@ -0,0 +1,136 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_FEC_H_
+#define PS_INTERNAL_FEC_H_
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "ps/base.h"
+namespace ps {
+
+/**
+ * \brief systematic Reed-Solomon erasure code over GF(2^8)
+ *
+ * A stripe of up to N data blocks gets M parity blocks, parity j being the
+ * sum of Coef(j, i) * block i. The coefficients are a Cauchy matrix with its
+ * columns scaled so that parity 0 is the plain XOR of the blocks, and any M
+ * lost blocks of a stripe can be solved back from any M parities. Blocks
+ * shorter than the parity count as zero padded. N + M must not exceed 256.
+ */
+class ReedSolomon {
+ public:
+  /** \brief the largest N + M */
+  static const int kMaxBlocks = 256;
+
+  /** \brief the coefficient of data block i in parity j */
+  static uint8_t Coef(int j, int i) {
+    if (j == 0) return 1;
+    // cauchy 1 / (x_j + y_i) with x_j = j and y_i = kMaxBlocks - 1 - i,
+    // divided by the coefficient of row 0 so that it becomes all ones
+    uint8_t y = kMaxBlocks - 1 - i;
+    return Div(y, static_cast<uint8_t>(j ^ y));
+  }
+
+  /** \brief dst += c * src over \a len bytes */
+  static void MulAdd(uint8_t c, const char* src, size_t len, char* dst) {
+    if (c == 0) return;
+    if (c == 1) {
+      for (size_t k = 0; k < len; ++k) dst[k] ^= src[k];
+      return;
+    }
+    const uint8_t* row = tables().mul[c];
+    const uint8_t* s = reinterpret_cast<const uint8_t*>(src);
+    uint8_t* d = reinterpret_cast<uint8_t*>(dst);
+    for (size_t k = 0; k < len; ++k) d[k] ^= row[s[k]];
+  }
+
+  /**
+   * \brief solve the lost blocks of a stripe
+   *
+   * \param rows the parities used, one per lost block
+   * \param lost the positions in the stripe of the lost blocks
+   * \param blocks for each row, its parity with every received block already
+   * subtracted with \ref MulAdd. replaced by the lost blocks, in order
+   * \param len the length of the parities
+   */
+  static void Solve(const std::vector<int>& rows, const std::vector<int>& lost,
+                    const std::vector<char*>& blocks, size_t len) {
+    size_t k = lost.size();
+    CHECK_EQ(rows.size(), k);
+    CHECK_EQ(blocks.size(), k);
+    // invert the k x k submatrix by gauss-jordan
+    std::vector<uint8_t> a(k * k), inv(k * k, 0);
+    for (size_t r = 0; r < k; ++r) {
+      for (size_t l = 0; l < k; ++l) a[r * k + l] = Coef(rows[r], lost[l]);
+      inv[r * k + r] = 1;
+    }
+    for (size_t col = 0; col < k; ++col) {
+      size_t p = col;
+      while (a[p * k + col] == 0) CHECK_LT(++p, k) << "singular stripe";
+      if (p != col) {
+        for (size_t l = 0; l < k; ++l) {
+          std::swap(a[p * k + l], a[col * k + l]);
+          std::swap(inv[p * k + l], inv[col * k + l]);
+        }
+      }
+      uint8_t scale = Div(1, a[col * k + col]);
+      for (size_t l = 0; l < k; ++l) {
+        a[col * k + l] = Mul(a[col * k + l], scale);
+        inv[col * k + l] = Mul(inv[col * k + l], scale);
+      }
+      for (size_t r = 0; r < k; ++r) {
+        uint8_t f = a[r * k + col];
+        if (r == col || f == 0) continue;
+        for (size_t l = 0; l < k; ++l) {
+          a[r * k + l] ^= Mul(f, a[col * k + l]);
+          inv[r * k + l] ^= Mul(f, inv[col * k + l]);
+        }
+      }
+    }
+    std::vector<char> out(k * len, 0);
+    for (size_t l = 0; l < k; ++l) {
+      for (size_t r = 0; r < k; ++r) {
+        MulAdd(inv[l * k + r], blocks[r], len, out.data() + l * len);
+      }
+    }
+    for (size_t l = 0; l < k; ++l) memcpy(blocks[l], out.data() + l * len, len);
+  }
+
+ private:
+  struct Tables {
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t mul[256][256];
+    Tables() {
+      // generator 2 of x^8 + x^4 + x^3 + x^2 + 1
+      int x = 1;
+      for (int i = 0; i < 255; ++i) {
+        exp[i] = exp[i + 255] = x;
+        log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+      }
+      exp[510] = exp[511] = 0;
+      log[0] = 0;
+      for (int a = 0; a < 256; ++a) {
+        for (int b = 0; b < 256; ++b) {
+          mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+        }
+      }
+    }
+  };
+  static const Tables& tables() {
+    static const Tables t;
+    return t;
+  }
+  static uint8_t Mul(uint8_t a, uint8_t b) { return tables().mul[a][b]; }
+  static uint8_t Div(uint8_t a, uint8_t b) {
+    if (a == 0) return 0;
+    const Tables& t = tables();
+    return t.exp[t.log[a] + 255 - t.log[b]];
+  }
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_FEC_H_
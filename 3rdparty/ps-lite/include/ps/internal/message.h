@@ -207,6 +207,26 @@ struct Meta {
           for(auto v : compr) ss << " " << v;
           ss << " ]";
       }
+      if(channel_sent.size()){
+          ss << ", channel_sent = [";
+          for(auto v : channel_sent) ss << " " << v;
+          ss << " ]";
+      }
+      if(channel_arrival.size()){
+          ss << ", channel_arrival = [";
+          for(auto v : channel_arrival) ss << " " << v;
+          ss << " ]";
+      }
+      if(missing_seq.size()){
+          ss << ", missing_seq = [";
+          for(auto v : missing_seq) ss << " " << v;
+          ss << " ]";
+      }
+      if(fec_seq.size()){
+          ss << ", fec_seq = [";
+          for(auto v : fec_seq) ss << " " << v;
+          ss << " ]";
+      }
 #endif
     if (!control.empty()) {
       ss << ", control={ " << control.DebugString() << " }";
@@ -248,10 +268,18 @@ struct Meta {
         int seq_end;
         bool udp_reliable;
         std::vector<float> compr;
-        int msg_type;     //point that the type of msg, push:paramter: 1 gradient/update:2 pull: request:3 default:0
+        int msg_type;     //point that the type of msg, push:paramter: 1 gradient/update:2 pull: request:3 fec parity:4 default:0
         int push_op_num;
         int val_bytes;
         int total_bytes;
+        /** DGT blocks of the push on each channel, set on its seq_end block */
+        std::vector<int> channel_sent;
+        /** per channel ratio of the blocks the server got in time, set on push responses */
+        std::vector<float> channel_arrival;
+        /** DGT blocks of the push the server did not get in time, set on push responses */
+        std::vector<int> missing_seq;
+        /** blocks a FEC parity (msg_type 4) covers, its seq being the parity index */
+        std::vector<int> fec_seq;
 #endif
         int channel;
   /** \brief the node id of the sender of this message */
@@ -0,0 +1,179 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_MPSC_QUEUE_H_
+#define PS_INTERNAL_MPSC_QUEUE_H_
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ps/base.h"
+namespace ps {
+
+/**
+ * \brief bounded lock-free queue for many producers and a single consumer
+ *
+ * Each slot of the ring carries a sequence number, so producers claim a slot
+ * with one CAS on the tail and the consumer never touches a lock while there
+ * is data to pop. The consumer only falls back to a condition variable after
+ * spinning on an empty ring; producers pay for the notify only in that case.
+ * When the ring is full, \ref Push yields until the consumer frees a slot.
+ */
+template<typename T> class MPSCQueue {
+ public:
+  /**
+   * \param capacity the number of slots, rounded up to a power of two
+   */
+  explicit MPSCQueue(size_t capacity = 1 << 16) {
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+    mask_ = cap - 1;
+    cells_.reset(new Cell[cap]);
+    for (size_t i = 0; i < cap; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  ~MPSCQueue() { }
+
+  /**
+   * \brief push an value into the end. threadsafe.
+   * \param new_value the value
+   */
+  void Push(T new_value) {
+    size_t pos = tail_.value.load(std::memory_order_relaxed);
+    while (true) {
+      Cell* cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (dif == 0) {
+        if (tail_.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell->value = std::move(new_value);
+          cell->seq.store(pos + 1, std::memory_order_release);
+          break;
+        }
+      } else if (dif < 0) {
+        // full, wait for the consumer to free a slot
+        std::this_thread::yield();
+        pos = tail_.value.load(std::memory_order_relaxed);
+      } else {
+        pos = tail_.value.load(std::memory_order_relaxed);
+      }
+    }
+    // pairs with the fence in WaitAndPopBatch so a sleeping consumer is
+    // either seen here or sees the new value before it sleeps
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting_.value.load(std::memory_order_relaxed)) {
+      std::lock_guard<std::mutex> lk(mu_);
+      cond_.notify_one();
+    }
+  }
+
+  /**
+   * \brief pop an element without blocking. only the consumer may call it
+   * \return false if the queue is empty
+   */
+  bool TryPop(T* value) {
+    size_t head = head_.value.load(std::memory_order_relaxed);
+    Cell* cell = &cells_[head & mask_];
+    if (cell->seq.load(std::memory_order_acquire) != head + 1) return false;
+    *value = std::move(cell->value);
+    cell->value = T();
+    cell->seq.store(head + mask_ + 1, std::memory_order_release);
+    head_.value.store(head + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * \brief append up to \a max_num elements to \a values without blocking.
+   * only the consumer may call it
+   * \return the number of popped elements
+   */
+  size_t TryPopBatch(std::vector<T>* values, size_t max_num) {
+    size_t n = 0;
+    T value;
+    while (n < max_num && TryPop(&value)) {
+      values->push_back(std::move(value));
+      ++n;
+    }
+    return n;
+  }
+
+  /**
+   * \brief wait until pop an element from the beginning, threadsafe
+   * \param value the poped value
+   */
+  void WaitAndPop(T* value) {
+    while (!TryPop(value)) Wait();
+  }
+
+  /**
+   * \brief wait until at least one element is available, then pop up to \a
+   * max_num of them. \a values is cleared first
+   * \return the number of popped elements
+   */
+  size_t WaitAndPopBatch(std::vector<T>* values, size_t max_num) {
+    values->clear();
+    size_t n = 0;
+    while ((n = TryPopBatch(values, max_num)) == 0) Wait();
+    return n;
+  }
+
+  /** \brief approximate number of queued elements, callable from any thread */
+  size_t Size() const {
+    size_t tail = tail_.value.load(std::memory_order_relaxed);
+    size_t head = head_.value.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+  bool empty() const { return Size() == 0; }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  bool Ready() const {
+    size_t head = head_.value.load(std::memory_order_relaxed);
+    return cells_[head & mask_].seq.load(std::memory_order_acquire) == head + 1;
+  }
+
+  /** \brief spin for a while, then sleep until a producer pushes */
+  void Wait() {
+    for (int i = 0; i < kSpinCount; ++i) {
+      if (Ready()) return;
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lk(mu_);
+    waiting_.value.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    cond_.wait(lk, [this]{ return Ready(); });
+    waiting_.value.store(false, std::memory_order_relaxed);
+  }
+
+  /**
+   * \brief an atomic a cache line away from the member before it. padded
+   * rather than alignas(64), which plain new does not honor before C++17
+   */
+  template <typename A> struct Padded {
+    Padded() : value(A()) { }
+    char pad[64];
+    std::atomic<A> value;
+  };
+
+  static const int kSpinCount = 64;
+  size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+  Padded<size_t> tail_;
+  Padded<size_t> head_;
+  Padded<bool> waiting_;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  DISALLOW_COPY_AND_ASSIGN(MPSCQueue);
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_MPSC_QUEUE_H_
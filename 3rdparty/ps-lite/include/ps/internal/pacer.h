@@ -0,0 +1,120 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_PACER_H_
+#define PS_INTERNAL_PACER_H_
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "ps/base.h"
+namespace ps {
+
+/**
+ * \brief token buckets pacing the bytes sent over each udp channel
+ *
+ * A channel earns tokens at its byte rate, up to a burst, and every block
+ * sent spends its size. A block larger than the burst waits for a full bucket
+ * and leaves it in debt. Rates may be changed from any thread while the
+ * sending thread is pacing; a rate of 0 leaves the channel unpaced.
+ */
+class Pacer {
+ public:
+  /** \brief default burst, in seconds worth of the rate */
+  static constexpr double kBurstSec = 0.001;
+  /** \brief the burst is never below one max udp datagram */
+  static constexpr double kMinBurst = 64 * 1024;
+
+  Pacer() { }
+
+  /**
+   * \brief set the number of channels, all unpaced. not threadsafe, call it
+   * before the sending thread starts
+   */
+  void Resize(int num_channels) {
+    buckets_.clear();
+    for (int i = 0; i < num_channels; ++i) buckets_.emplace_back(new Bucket());
+  }
+
+  /**
+   * \brief retarget a channel, threadsafe
+   * \param channel 0-based udp channel, -1 for all of them
+   * \param bytes_per_sec the new rate, 0 to stop pacing the channel
+   * \param burst_bytes the bucket size, 0 for the default
+   */
+  void SetRate(int channel, double bytes_per_sec, double burst_bytes = 0) {
+    if (channel < 0) {
+      for (size_t i = 0; i < buckets_.size(); ++i) SetRate(i, bytes_per_sec, burst_bytes);
+      return;
+    }
+    CHECK_LT(static_cast<size_t>(channel), buckets_.size());
+    bytes_per_sec = std::max(0.0, bytes_per_sec);
+    if (burst_bytes <= 0) burst_bytes = bytes_per_sec * kBurstSec;
+    if (burst_bytes < kMinBurst) burst_bytes = kMinBurst;
+    buckets_[channel]->burst = burst_bytes;
+    buckets_[channel]->rate = bytes_per_sec;
+  }
+
+  /** \brief the rate of a channel in bytes/sec, 0 if unpaced */
+  double GetRate(int channel) const {
+    CHECK_LT(static_cast<size_t>(channel), buckets_.size());
+    return buckets_[channel]->rate;
+  }
+
+  /** \brief whether any channel is paced */
+  bool enabled() const {
+    for (const auto& b : buckets_) {
+      if (b->rate > 0) return true;
+    }
+    return false;
+  }
+
+  /**
+   * \brief spend the tokens for \a bytes on \a channel if the bucket has them.
+   * only the sending thread may call it
+   */
+  bool TryAcquire(int channel, size_t bytes) {
+    if (static_cast<size_t>(channel) >= buckets_.size()) return true;
+    Bucket* b = buckets_[channel].get();
+    double rate = b->rate;
+    if (rate <= 0) return true;
+    double burst = b->burst;
+    auto now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - b->last).count();
+    b->last = now;
+    b->tokens = std::min(burst, b->tokens + rate * elapsed);
+    if (b->tokens < std::min(static_cast<double>(bytes), burst)) return false;
+    b->tokens -= bytes;
+    return true;
+  }
+
+  /**
+   * \brief wait until the tokens for \a bytes are there, then spend them.
+   * only the sending thread may call it
+   */
+  void Acquire(int channel, size_t bytes) {
+    while (!TryAcquire(channel, bytes)) {
+      Bucket* b = buckets_[channel].get();
+      double rate = b->rate;
+      if (rate <= 0) continue;
+      double need = std::min(static_cast<double>(bytes), b->burst.load()) - b->tokens;
+      std::this_thread::sleep_for(std::chrono::duration<double>(need / rate));
+    }
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+  struct Bucket {
+    std::atomic<double> rate{0};
+    std::atomic<double> burst{kMinBurst};
+    /** \brief owned by the sending thread */
+    double tokens = 0;
+    Clock::time_point last = Clock::now();
+  };
+  std::vector<std::unique_ptr<Bucket>> buckets_;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_PACER_H_
@@ -0,0 +1,254 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_QUANTIZE_H_
+#define PS_INTERNAL_QUANTIZE_H_
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include "ps/internal/simd.h"
+namespace ps {
+
+/**
+ * \brief uniform quantization of a range of floats to 1, 2, 4 or 8 bits
+ *
+ * A value becomes the level q in [0, 2^bits - 1] of min + q * step. Levels
+ * are packed little endian, value i at bit (i * bits) % 8 of byte
+ * i * bits / 8.
+ */
+struct QuantizeParam {
+  int bits = 2;
+  float min = 0;
+  float step = 0;
+  /**
+   * \brief round stochastically, unbiased, with this xorshift seed if non
+   * zero. rounds to the nearest level otherwise
+   */
+  uint32_t seed = 0;
+};
+
+/** \brief the bytes n values take at \a bits */
+inline size_t QuantizedBytes(size_t n, int bits) {
+  return (n * bits + 7) / 8;
+}
+
+inline uint32_t XorShift(uint32_t x) {
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+inline void MinMaxScalar(const float* x, size_t n, float* min, float* max) {
+  float lo = n ? x[0] : 0, hi = lo;
+  for (size_t i = 0; i < n; ++i) {
+    lo = std::min(lo, x[i]);
+    hi = std::max(hi, x[i]);
+  }
+  *min = lo;
+  *max = hi;
+}
+
+/**
+ * \brief quantize n values of \a v into \a out, plain C++. \a v is left with
+ * what the rounding lost, for the caller to add to the next values
+ */
+inline void QuantizeScalar(float* v, size_t n, const QuantizeParam& p, char* out) {
+  const int per_byte = 8 / p.bits;
+  const float top = (1 << p.bits) - 1;
+  const float inv = p.step > 0 ? 1 / p.step : 0;
+  uint8_t* o = reinterpret_cast<uint8_t*>(out);
+  memset(o, 0, QuantizedBytes(n, p.bits));
+  uint32_t state = p.seed;
+  for (size_t i = 0; i < n; ++i) {
+    float t = (v[i] - p.min) * inv;
+    if (p.seed) {
+      state = XorShift(state);
+      t = std::floor(t + (state >> 8) * (1.0f / (1 << 24)));
+    }
+    t = std::min(std::max(t, 0.0f), top);
+    int q = static_cast<int>(std::nearbyint(t));
+    v[i] -= p.min + q * p.step;
+    o[i / per_byte] |= q << ((i % per_byte) * p.bits);
+  }
+}
+
+/** \brief the n values quantized in \a in, plain C++ */
+inline void DequantizeScalar(const char* in, size_t n, const QuantizeParam& p, float* out) {
+  const int per_byte = 8 / p.bits;
+  const int mask = (1 << p.bits) - 1;
+  const uint8_t* s = reinterpret_cast<const uint8_t*>(in);
+  for (size_t i = 0; i < n; ++i) {
+    int q = (s[i / per_byte] >> ((i % per_byte) * p.bits)) & mask;
+    out[i] = p.min + q * p.step;
+  }
+}
+
+#ifdef PS_SIMD_X86
+/** \brief the low \a bits of every byte, what pext / pdep pack 8 levels with */
+inline uint64_t LevelMask(int bits) {
+  return 0x0101010101010101ULL * ((1u << bits) - 1);
+}
+
+__attribute__((target("avx2")))
+inline void MinMaxAVX2(const float* x, size_t n, float* min, float* max) {
+  if (n < 8) return MinMaxScalar(x, n, min, max);
+  __m256 lo = _mm256_loadu_ps(x), hi = lo;
+  size_t i = 8;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_loadu_ps(x + i);
+    lo = _mm256_min_ps(lo, v);
+    hi = _mm256_max_ps(hi, v);
+  }
+  alignas(32) float l[8], h[8];
+  _mm256_store_ps(l, lo);
+  _mm256_store_ps(h, hi);
+  float lo_s = *std::min_element(l, l + 8), hi_s = *std::max_element(h, h + 8);
+  for (; i < n; ++i) {
+    lo_s = std::min(lo_s, x[i]);
+    hi_s = std::max(hi_s, x[i]);
+  }
+  *min = lo_s;
+  *max = hi_s;
+}
+
+/**
+ * \brief AVX2 quantization, 32 values at a time. rounding to the nearest
+ * level gives the same bytes and residual as \ref QuantizeScalar
+ */
+__attribute__((target("avx2,bmi2")))
+inline void QuantizeAVX2(float* v, size_t n, const QuantizeParam& p, char* out) {
+  const __m256 vmin = _mm256_set1_ps(p.min);
+  const __m256 vstep = _mm256_set1_ps(p.step);
+  const __m256 vinv = _mm256_set1_ps(p.step > 0 ? 1 / p.step : 0);
+  const __m256 vtop = _mm256_set1_ps((1 << p.bits) - 1);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 unit = _mm256_set1_ps(1.0f / (1 << 24));
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  const uint64_t mask = LevelMask(p.bits);
+  __m256i state = _mm256_setzero_si256();
+  if (p.seed) {
+    alignas(32) uint32_t s[8];
+    for (int k = 0; k < 8; ++k) s[k] = (p.seed + 0x9e3779b9u * (k + 1)) | 1;
+    state = _mm256_load_si256(reinterpret_cast<const __m256i*>(s));
+  }
+  uint8_t* o = reinterpret_cast<uint8_t*>(out);
+  alignas(32) uint8_t levels[32];
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i q[4];
+    for (int k = 0; k < 4; ++k) {
+      __m256 x = _mm256_loadu_ps(v + i + 8 * k);
+      __m256 t = _mm256_mul_ps(_mm256_sub_ps(x, vmin), vinv);
+      if (p.seed) {
+        state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+        state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+        state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+        __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(state, 8)), unit);
+        t = _mm256_floor_ps(_mm256_add_ps(t, u));
+      }
+      t = _mm256_min_ps(_mm256_max_ps(t, zero), vtop);
+      q[k] = _mm256_cvtps_epi32(t);
+      __m256 level = _mm256_add_ps(vmin, _mm256_mul_ps(_mm256_cvtepi32_ps(q[k]), vstep));
+      _mm256_storeu_ps(v + i + 8 * k, _mm256_sub_ps(x, level));
+    }
+    // the packs work per 128 bit lane, the permute puts the levels back in order
+    __m256i b = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]),
+                                    _mm256_packs_epi32(q[2], q[3]));
+    b = _mm256_permutevar8x32_epi32(b, order);
+    if (p.bits == 8) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), b);
+      o += 32;
+      continue;
+    }
+    _mm256_store_si256(reinterpret_cast<__m256i*>(levels), b);
+    for (int k = 0; k < 32; k += 8) {
+      uint64_t x;
+      memcpy(&x, levels + k, 8);
+      uint64_t packed = _pext_u64(x, mask);
+      memcpy(o, &packed, p.bits);
+      o += p.bits;
+    }
+  }
+  QuantizeParam rest = p;
+  if (p.seed) rest.seed = XorShift(p.seed ^ static_cast<uint32_t>(i)) | 1;
+  QuantizeScalar(v + i, n - i, rest, out + i * p.bits / 8);
+}
+
+__attribute__((target("avx2,bmi2")))
+inline void DequantizeAVX2(const char* in, size_t n, const QuantizeParam& p, float* out) {
+  const __m256 vmin = _mm256_set1_ps(p.min);
+  const __m256 vstep = _mm256_set1_ps(p.step);
+  const uint64_t mask = LevelMask(p.bits);
+  const uint64_t low = p.bits == 8 ? ~0ULL : (1ULL << (8 * p.bits)) - 1;
+  const uint8_t* s = reinterpret_cast<const uint8_t*>(in);
+  size_t i = 0;
+  // whole 8 byte loads while the input has them
+  for (; i + 64 <= n; i += 8) {
+    uint64_t x;
+    memcpy(&x, s, 8);
+    x &= low;
+    s += p.bits;
+    if (p.bits != 8) x = _pdep_u64(x, mask);
+    __m256i q = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(x));
+    _mm256_storeu_ps(out + i, _mm256_add_ps(vmin, _mm256_mul_ps(_mm256_cvtepi32_ps(q), vstep)));
+  }
+  for (; i + 8 <= n; i += 8) {
+    uint64_t x = 0;
+    memcpy(&x, s, p.bits);
+    s += p.bits;
+    if (p.bits != 8) x = _pdep_u64(x, mask);
+    __m256i q = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(x));
+    _mm256_storeu_ps(out + i, _mm256_add_ps(vmin, _mm256_mul_ps(_mm256_cvtepi32_ps(q), vstep)));
+  }
+  DequantizeScalar(in + i * p.bits / 8, n - i, p, out + i);
+}
+
+inline bool QuantizeAVX2Supported() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+}
+#endif  // PS_SIMD_X86
+
+/** \brief the smallest and largest of n floats, n may be 0 */
+inline void MinMax(const float* x, size_t n, float* min, float* max) {
+  typedef void (*Kernel)(const float*, size_t, float*, float*);
+  static const Kernel kernel = []() -> Kernel {
+#ifdef PS_SIMD_X86
+      if (QuantizeAVX2Supported()) return MinMaxAVX2;
+#endif
+      return MinMaxScalar;
+    }();
+  kernel(x, n, min, max);
+}
+
+/**
+ * \brief quantize n values of \a v into the QuantizedBytes of \a out with the
+ * widest kernel the cpu runs. \a v is left with what the rounding lost
+ */
+inline void Quantize(float* v, size_t n, const QuantizeParam& p, char* out) {
+  typedef void (*Kernel)(float*, size_t, const QuantizeParam&, char*);
+  static const Kernel kernel = []() -> Kernel {
+#ifdef PS_SIMD_X86
+      if (QuantizeAVX2Supported()) return QuantizeAVX2;
+#endif
+      return QuantizeScalar;
+    }();
+  kernel(v, n, p, out);
+}
+
+/** \brief the n values quantized in \a in */
+inline void Dequantize(const char* in, size_t n, const QuantizeParam& p, float* out) {
+  typedef void (*Kernel)(const char*, size_t, const QuantizeParam&, float*);
+  static const Kernel kernel = []() -> Kernel {
+#ifdef PS_SIMD_X86
+      if (QuantizeAVX2Supported()) return DequantizeAVX2;
+#endif
+      return DequantizeScalar;
+    }();
+  kernel(in, n, p, out);
+}
+
+}  // namespace ps
+#endif  // PS_INTERNAL_QUANTIZE_H_
@@ -0,0 +1,63 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_SEND_HEAP_H_
+#define PS_INTERNAL_SEND_HEAP_H_
+#include <queue>
+#include <utility>
+#include <vector>
+#include "ps/internal/message.h"
+namespace ps {
+
+/**
+ * \brief the messages a send scheduler has taken off its queue but not sent
+ * yet, highest Meta::priority first
+ *
+ * Messages of the same priority keep the order they were pushed in, so the
+ * blocks of a key, which all carry the priority of the key, go out in order.
+ * A key of a higher priority queued later still passes the blocks of the keys
+ * waiting, which preempts a large push at block granularity. Only the
+ * scheduler thread owning it touches it.
+ */
+class SendHeap {
+ public:
+  void Push(Message&& msg) {
+    int priority = msg.meta.priority;
+    heap_.push(Item{priority, seq_++, std::move(msg)});
+  }
+
+  /** \brief move the next message to send into \a msg */
+  void Pop(Message* msg) {
+    *msg = std::move(const_cast<Item&>(heap_.top()).msg);
+    heap_.pop();
+  }
+
+  /** \brief append up to \a max_num messages to \a msgs, the next ones first */
+  size_t PopBatch(std::vector<Message>* msgs, size_t max_num) {
+    size_t n = 0;
+    for (; n < max_num && !heap_.empty(); ++n) {
+      msgs->emplace_back();
+      Pop(&msgs->back());
+    }
+    return n;
+  }
+
+  bool empty() const { return heap_.empty(); }
+  size_t size() const { return heap_.size(); }
+
+ private:
+  struct Item {
+    int priority;
+    /** keeps the messages of a priority in order */
+    uint64_t seq;
+    Message msg;
+    bool operator<(const Item& other) const {
+      return priority != other.priority ? priority < other.priority : seq > other.seq;
+    }
+  };
+  std::priority_queue<Item> heap_;
+  uint64_t seq_ = 0;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_SEND_HEAP_H_
@@ -0,0 +1,77 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_SIMD_H_
+#define PS_INTERNAL_SIMD_H_
+#include <cmath>
+#include <cstddef>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PS_SIMD_X86 1
+#endif
+namespace ps {
+
+/**
+ * \brief sum of |x| over n floats, plain C++
+ */
+inline float AbsSumScalar(const float* x, size_t n) {
+  float sum = 0;
+  for (size_t i = 0; i < n; ++i) sum += std::fabs(x[i]);
+  return sum;
+}
+
+#ifdef PS_SIMD_X86
+__attribute__((target("avx2")))
+inline float AbsSumAVX2(const float* x, size_t n) {
+  const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    s0 = _mm256_add_ps(s0, _mm256_and_ps(_mm256_loadu_ps(x + i), mask));
+    s1 = _mm256_add_ps(s1, _mm256_and_ps(_mm256_loadu_ps(x + i + 8), mask));
+  }
+  s0 = _mm256_add_ps(s0, s1);
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s) + AbsSumScalar(x + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+inline float AbsSumAVX512(const float* x, size_t n) {
+  const __m512i mask = _mm512_set1_epi32(0x7fffffff);
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    s0 = _mm512_add_ps(s0, _mm512_castsi512_ps(
+        _mm512_and_si512(_mm512_castps_si512(_mm512_loadu_ps(x + i)), mask)));
+    s1 = _mm512_add_ps(s1, _mm512_castsi512_ps(
+        _mm512_and_si512(_mm512_castps_si512(_mm512_loadu_ps(x + i + 16)), mask)));
+  }
+  alignas(64) float lanes[16];
+  _mm512_store_ps(lanes, _mm512_add_ps(s0, s1));
+  float sum = 0;
+  for (int j = 0; j < 16; ++j) sum += lanes[j];
+  return sum + AbsSumScalar(x + i, n - i);
+}
+#endif  // PS_SIMD_X86
+
+/**
+ * \brief sum of |x| over n floats with the widest kernel the cpu runs,
+ * picked once at the first call
+ */
+inline float AbsSum(const float* x, size_t n) {
+  typedef float (*Kernel)(const float*, size_t);
+  static const Kernel kernel = []() -> Kernel {
+#ifdef PS_SIMD_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f")) return AbsSumAVX512;
+      if (__builtin_cpu_supports("avx2")) return AbsSumAVX2;
+#endif
+      return AbsSumScalar;
+    }();
+  return kernel(x, n);
+}
+
+}  // namespace ps
+#endif  // PS_INTERNAL_SIMD_H_
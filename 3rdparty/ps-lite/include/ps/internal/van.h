@@ -4,6 +4,8 @@
 #ifndef PS_INTERNAL_VAN_H_
 #define PS_INTERNAL_VAN_H_
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <ctime>
 #include <memory>
 #include <mutex>
@@ -15,6 +17,10 @@
 #include "ps/base.h"
 #include "ps/internal/message.h"
 #include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/mpsc_queue.h"
+#include "ps/internal/pacer.h"
+#include "ps/internal/fault.h"
+#include "ps/internal/send_heap.h"
 #include "customer.h"
 #ifndef ADAPTIVE_K
 #define ADAPTIVE_K
@@ -69,7 +75,8 @@ class Van {
 #endif
     /*channel = 0 means tcp channel 1->udp channel tag = 0 means send imediately.*/
 	int Send(Message &msg, int channel = 0, int tag = 0);
-    int Classifier( Message& msg, int channel=0, int tag=0);
+    /** \brief move \a msg into the tcp (channel 0) or udp send queue */
+    int Classifier( Message&& msg, int channel=0, int tag=0);
     void MergeMsg(Message* msg1, Message* msg2);
     void ZeroMsg(Message* msg1);
     void ZeroSArray(char *sa,int size);
@@ -88,11 +95,26 @@ class Van {
         int Send(Message &msg);
 #endif
 #ifdef ENCODE
+        /**
+         * \brief quantize the gradient block of \a msg to DGT_ENCODE_BITS per
+         * value, the rounding error kept for the next push of the key
+         * \return the encoded size relative to the raw one
+         */
         float encode(Message& msg);
-        void decode(Message& msg);
+        /**
+         * \brief the floats of a block \ref encode quantized
+         * \return false if the block is not a valid encoded one
+         */
+        bool decode(Message& msg);
         void msg_float_print(Message& msg, int n);
+        /** first_key -> rounding error left in each float of the key. encode_mu_ guards the map */
         std::unordered_map<int, SArray<char>> residual;
+        std::mutex encode_mu_;
         int enable_encode=0;
+        /** bits per encoded value, 1, 2, 4 or 8, DGT_ENCODE_BITS */
+        int encode_bits_ = 2;
+        /** round stochastically instead of to the nearest level, DGT_ENCODE_STOCHASTIC */
+        bool encode_stochastic_ = false;
 #endif
   /**
    * \brief return my node
@@ -118,6 +140,56 @@ class Van {
    */
   inline bool IsReady() { return ready_; }
 
+  /**
+   * \brief payload bytes sent over the unreliable (udp) channels
+   */
+  inline size_t udp_send_bytes() const { return udp_send_bytes_; }
+
+  /**
+   * \brief bytes memcpy'd into a staging buffer on the way to the udp
+   * channels. zero when datagrams are gathered straight from the SArrays
+   */
+  inline size_t udp_copy_bytes() const { return udp_copy_bytes_; }
+
+  /**
+   * \brief the most bytes a datagram of a DGT block of one key takes next
+   * to its values: the meta as \ref PackMeta writes it, with every field at
+   * its widest, its size, the key and its len
+   * \param msg_type 2 for push blocks, 5 for pull blocks
+   * \param num_channels the udp channels, one channel_sent each
+   */
+  int BlockOverhead(int msg_type, int num_channels);
+
+#ifdef RECONSTRUCT
+  /** \brief DGT blocks seen by the server reassembly */
+  struct BlockStats {
+    /** per channel, 0 being tcp: blocks in time for their push */
+    std::vector<size_t> on_time;
+    /** per channel: value bytes of the blocks in time */
+    std::vector<size_t> on_time_bytes;
+    /** per channel: blocks of a push that was already accepted */
+    std::vector<size_t> late;
+    /** blocks filled in by DGT_MISSING_POLICY */
+    size_t missing = 0;
+    /** lost blocks solved from the FEC parities */
+    size_t recovered = 0;
+  };
+  /** \brief a snapshot of the block counters. thread safe */
+  BlockStats GetBlockStats();
+
+  /**
+   * \brief retarget the byte rate of a udp channel at runtime. thread safe
+   * \param channel 0-based udp channel, -1 for all of them
+   * \param bytes_per_sec the new rate, 0 to send as fast as possible
+   */
+  inline void SetUDPRate(int channel, double bytes_per_sec) {
+    pacer_.SetRate(channel, bytes_per_sec);
+  }
+
+  /** \brief per udp channel, the datagrams lost to DGT_UDP_DROP */
+  inline std::vector<size_t> udp_dropped() const { return faults_.dropped(); }
+#endif
+
  protected:
   /**
    * \brief connect to a node
@@ -138,6 +210,11 @@ class Van {
 #endif
         virtual int RecvMsg_TCP(Message *msg) = 0;
         virtual int RecvMsg_UDP(int channel, Message *msg) = 0;
+        /**
+         * \brief make the udp receiving threads blocked in RecvMsg_UDP
+         * return, so they see udp_stop_ and leave. may be called repeatedly
+         */
+        virtual void WakeUDPReceivers() { }
   /**
    * \brief block until received a message
    * \return the number of bytes received. -1 if failed or timeout
@@ -150,6 +227,12 @@ class Van {
    */
 
   virtual int SendMsg_UDP(int channel, Message &msg, int tag = 0) = 0;
+  /**
+   * \brief send a batch of blocks popped by the Unimportant scheduler, each
+   * over its own meta.channel. the default sends them one by one
+   * \return the number of bytes sent, -1 if failed
+   */
+  virtual int SendMsgBatch_UDP(std::vector<Message> *msgs);
   virtual int SendMsg_TCP(Message &msg, int tag = 0) = 0;
 
   virtual int SendMsg(const Message &msg) = 0;
@@ -168,11 +251,48 @@ class Van {
    * \brief unpack meta from a string
    */
   void UnpackMeta(const char *meta_buf, int buf_size, Meta *meta);
+  /**
+   * \brief unpack meta from a datagram, which may be truncated or foreign
+   * \return false, with a warning, if it is no meta this node reads
+   */
+  bool TryUnpackMeta(const char *meta_buf, int buf_size, Meta *meta);
+  /**
+   * \brief whether the n data lens a datagram meta announces, starting at
+   * offset, fit in the size bytes received
+   */
+  static bool DataFits(const int* lens, int n, size_t offset, size_t size) {
+    for (int k = 0; k < n; ++k) {
+      if (lens[k] < 0 || offset + lens[k] > size) return false;
+      offset += lens[k];
+    }
+    return true;
+  }
+
+#ifdef UDP_CHANNEL
+  /**
+   * \brief pack the meta of a DGT block (msg_type 2) into a fixed layout
+   * header, much shorter and cheaper than the protobuf
+   * \return false if the meta has fields the header does not carry
+   */
+  bool PackBlockMeta(const Meta &meta, char **meta_buf, int *buf_size);
+  /** \brief unpack a header of \ref PackBlockMeta, false if it is not a valid one */
+  bool UnpackBlockMeta(const char *meta_buf, int buf_size, Meta *meta);
+  /** \brief send DGT blocks with \ref PackBlockMeta, DGT_BLOCK_HEADER */
+  int block_header_ = 1;
+#endif
 
   Node scheduler_;
   Node my_node_;
   bool is_scheduler_;
   std::mutex start_mu_;
+  std::atomic<size_t> udp_send_bytes_{0};
+  std::atomic<size_t> udp_copy_bytes_{0};
+  /** \brief receiving threads per udp channel, DGT_UDP_RECV_THREADS */
+  int udp_recv_threads_ = 1;
+  /** \brief set by Stop, the udp receiving threads leave at their next message */
+  std::atomic<bool> udp_stop_{false};
+  /** \brief udp receiving threads not left yet */
+  std::atomic<int> udp_receivers_{0};
 public:
     /** msg resender */
     Resender *resender_ = nullptr;
@@ -181,6 +301,12 @@ public:
   void Receiving_TCP();
   void Receiving_UDP(int channel);
   void Receiving();
+  /** decode a udp data message if needed and process it */
+  void ProcessUDPData(Message* msg);
+#ifdef RECONSTRUCT
+  /** thread function handing on the udp data held by DGT_UDP_DELAY_US */
+  void Delaying_UDP();
+#endif
 
   /** thread function for heartbeat */
   void Heartbeat();
@@ -205,13 +331,189 @@ public:
         std::unordered_map<int,std::unordered_map<int, std::unordered_map<int,Meta>>> meta_map;
     std::unordered_map<int,std::unordered_map<int, std::unordered_map<int,SArray<char>>>> recv_map;
     std::unordered_map<int,std::unordered_map<int, std::unordered_map<int,Message>>> msg_map;
-    std::unordered_map<int,std::unordered_map<int, Message>> msg_buffer;
+    /** \brief a pushed gradient put back together from its DGT blocks */
+    struct Reassembly {
+      /** two buffers, the last accepted push may still hold the other one */
+      SArray<char> bufs[2];
+      int cur = 0;
+      /** bufs[cur] has not been written since the last push was accepted */
+      bool fresh = true;
+      /** push_op_num of the block at seq in bufs[cur], 0 until it came */
+      std::vector<int> received;
+      size_t num_received = 0;
+      /** the seq_end block, once it came and the push waits for the rest */
+      Message last;
+      bool has_last = false;
+      std::chrono::steady_clock::time_point deadline;
+      /** push_op_num of the last accepted push */
+      int done_push = 0;
+      /** blocks of this push in time, per channel */
+      std::vector<int> channel_received;
+      /** seqs FinishReassembly had to fill in */
+      std::vector<int> missing;
+      /** FEC parities of the push, until their stripes are complete */
+      std::vector<Message> parity;
+      /** the last accepted push, DGT_MISSING_POLICY 1 reuses its blocks */
+      Message accepted;
+      /** late blocks of accepted pushes, added once their seq of this push is in */
+      std::vector<Message> late;
+    };
+    /**
+     * \brief the reassemblies of a range of keys. the receiving threads
+     * reassemble keys of different shards at the same time
+     */
+    struct ReassemblyShard {
+      std::mutex mu;
+      /** (sender << 32 | first_key) -> its reassembly */
+      std::unordered_map<uint64_t, Reassembly> reassembly;
+      /** reassemblies waiting for their deadline */
+      std::vector<uint64_t> pending;
+      BlockStats stats;
+    };
+    /** first_key % size, DGT_SERVER_THREADS of them */
+    std::vector<std::unique_ptr<ReassemblyShard>> shards_;
+    inline ReassemblyShard* GetShard(Key first_key) {
+      return shards_[first_key % shards_.size()].get();
+    }
+    /**
+     * \brief copy a block of the current push into its reassembly at val_bytes,
+     * add a late block of an accepted push on top of it
+     * \return true if the block is new to the current push
+     */
+    bool Reassemble(const Message& msg, Reassembly* r);
+    /** \brief fill in the blocks that never came, then hand back the full buffer */
+    SArray<char> FinishReassembly(const Message& last, Reassembly* r, BlockStats* stats);
+    /** \brief accept the push waiting in \a r */
+    void AcceptReassembly(Reassembly* r, BlockStats* stats);
+    /** \brief solve the lost blocks of every stripe of \a r that has enough parities */
+    void RecoverStripes(Reassembly* r, BlockStats* stats);
+    /** \brief thread function accepting pushes whose deadline passed */
+    void Reassembly_timer();
+    /**
+     * \brief how long a push waits for missing blocks after its seq_end
+     * block, DGT_REASSEMBLY_DEADLINE_US. 0 accepts it at seq_end
+     */
+    int reassembly_deadline_us_ = 0;
+    /** 0: zero missing blocks, 1: reuse them from the last push, 2: scale the received ones, DGT_MISSING_POLICY */
+    int missing_policy_ = 0;
+    /**
+     * \brief the workers push the blocks reported missing again,
+     * DGT_ERROR_FEEDBACK, so their late blocks are dropped instead of added
+     * to the next push
+     */
+    int error_feedback_ = 0;
+    /** timer_mu_ guards reassembly_stop_ and pending_kick_, set when a shard got a pending reassembly */
+    std::mutex timer_mu_;
+    std::condition_variable pending_cond_;
+    bool pending_kick_ = false;
+    bool reassembly_stop_ = false;
+    std::unique_ptr<std::thread> reassembly_thread_;
+    /** \brief decayed per channel counts of the DGT blocks of a sender */
+    struct ChannelArrival {
+      std::vector<double> sent;
+      std::vector<double> received;
+    };
+    /** sender -> its arrival counts. arrival_mu_ guards it and missing_ */
+    std::unordered_map<int, ChannelArrival> arrival_;
+    std::mutex arrival_mu_;
+    /** weight of the past in the arrival counts per accepted push, DGT_ARRIVAL_DECAY */
+    double arrival_decay_ = 0.99;
+    /** (sender << 32 | timestamp) -> missing seqs of an accepted push, until its response */
+    std::unordered_map<uint64_t, std::vector<int>> missing_;
+    /**
+     * \brief count the blocks of the push accepted from \a r against its
+     * channel_sent, and keep its missing seqs for the response
+     */
+    void UpdateFeedback(const Message& last, Reassembly* r);
+    /** \brief put the arrival ratios and missing seqs of the receiver on a push response */
+    void StampFeedback(Message* msg);
+    /** \brief a worker's copy of a value pulled as DGT blocks */
+    struct PullCopy {
+      SArray<char> vals;
+      /** the pull the copy was last written by */
+      int num = 0;
+      /** pull num of the block at seq, 0 until it came */
+      std::vector<int> received;
+      size_t num_received = 0;
+      /** the seq_end block, once it came and the pull waits for the rest */
+      Message last;
+      bool has_last = false;
+      std::chrono::steady_clock::time_point deadline;
+    };
+    /** pull_copy_mu_ guards pull_copy_ and pull_pending_ */
+    std::mutex pull_copy_mu_;
+    /** (server << 32 | first_key) -> its copy */
+    std::unordered_map<uint64_t, PullCopy> pull_copy_;
+    /** the copies waiting for blocks past their seq_end block */
+    std::vector<uint64_t> pull_pending_;
+    /** how long a worker waits for the udp blocks of a pull, DGT_PULL_DEADLINE_US */
+    int pull_deadline_us_ = 0;
+    /**
+     * \brief write a DGT pull block (msg_type 5) into its copy
+     * \return true once \a msg holds the whole value, i.e. all blocks came or
+     * the seq_end block came without a deadline, the blocks lost on the way
+     * keeping their previous values
+     */
+    bool ReassemblePull(Message* msg);
+    /** \brief turn the seq_end block of \a c into the whole value and hand it to its app */
+    void AcceptPull(PullCopy* c);
+    /** \brief the seq_end block of \a c with a copy of the whole value */
+    Message FinishPull(PullCopy* c);
     std::unordered_map<int,std::unordered_map<int, std::unordered_map<int,int>>> recv_flag;
     int msg_size_limit = 4096;
     int reconstruct = 0;
     unsigned int ns_delay = 0;
-    ThreadsafeQueue<Message> important_queue_;
-    ThreadsafeQueue<Message> unimportant_queue_;
+    /** max number of blocks a DGT scheduler thread pops at once */
+    int send_batch_ = 64;
+    /** send the queued blocks by priority instead of in order, DGT_SEND_PRIORITY */
+    int send_priority_ = 0;
+    /**
+     * \brief move all that is queued into \a heap, waiting if both are empty,
+     * then pop the \a max_num most urgent messages into \a batch
+     */
+    void PopByPriority(MPSCQueue<Message>* queue, SendHeap* heap,
+                       std::vector<Message>* batch, size_t max_num);
+    /** paces the udp channels, DGT_UDP_RATE */
+    Pacer pacer_;
+    /** loses and delays the received datagrams, DGT_UDP_DROP / DGT_UDP_DELAY_US */
+    FaultInjector faults_;
+    /** added to the node id to seed \ref faults_, DGT_UDP_FAULT_SEED */
+    unsigned fault_seed_ = 0;
+    /** the delayed udp data, null unless a channel has a delay */
+    std::unique_ptr<DelayLine<Message>> delay_line_;
+    std::unique_ptr<std::thread> delay_thread_;
+    /** \brief data and parity blocks per stripe of a udp channel, DGT_FEC */
+    struct FECConfig {
+      int data = 0;
+      int parity = 0;
+    };
+    /** per udp channel, empty if no channel has parities */
+    std::vector<FECConfig> fec_;
+    /** \brief the open stripe of a key on a udp channel */
+    struct Stripe {
+      std::vector<int> seqs;
+      std::vector<SArray<char>> parity;
+      size_t len = 0;
+    };
+    /** (recver << 32 | first_key) -> its open stripe per udp channel */
+    std::unordered_map<uint64_t, std::vector<Stripe>> stripes_;
+    std::mutex fec_mu_;
+    /** \brief the open stripes of the key of \a msg, one per udp channel */
+    std::vector<Stripe>* GetStripes(const Message& msg);
+    /** \brief add a block to the stripe of its channel, emit the parities once it is full */
+    void AddToStripe(const Message& msg, int channel);
+    /** \brief queue the parities of a stripe and reset it. \a block gives the meta */
+    void EmitParity(const Message& block, int channel, Stripe* s);
+    /** how long the udp sender waits for pending tcp blocks, DGT_UDP_YIELD_US */
+    int yield_us_ = 1000;
+    /** \brief wait until the tcp queue is drained, at most yield_us_ */
+    void YieldToImportant();
+    /** \brief signaled by the tcp send thread when it drained its queue */
+    std::mutex yield_mu_;
+    std::condition_variable yield_cond_;
+    /** the send queues of the schedulers, made in Start by the nodes running them */
+    std::unique_ptr<MPSCQueue<Message>> important_queue_;
+    std::unique_ptr<MPSCQueue<Message>> unimportant_queue_;
 #endif
 #ifdef DOUBLE_CHANNEL
         /** the thread for receiving tcp messages */
@@ -219,7 +521,6 @@ public:
 
 	/** the thread for receiving udp messages */
 
-    std::unique_ptr<std::thread> udp_receiver_thread_[8];
     std::vector<std::unique_ptr<std::thread>> udp_receiver_thread_vec;
     std::unique_ptr<std::thread> important_scheduler_thread_;
     std::unique_ptr<std::thread> unimportant_scheduler_thread_;
@@ -4,6 +4,10 @@
 #ifndef PS_KV_APP_H_
 #define PS_KV_APP_H_
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <unordered_map>
@@ -11,6 +15,8 @@
 #include "ps/simple_app.h"
 #include <unistd.h>
 #include "ps/internal/message.h"
+#include "ps/internal/simd.h"
+#include "ps/internal/threadsafe_queue.h"
 #include <zmq.h>
 #include <time.h>
 #include <math.h>
@@ -44,6 +50,122 @@
 #endif
 namespace ps {
 
+/**
+ * \brief split ranked DGT blocks into channels by their contri
+ *
+ * The top round(k * (rank->size() + num_final)) go to tcp and the rest to C
+ * bins, one per udp channel, sized by the arrival ratio of the channel
+ * (channel 0 being tcp) or equal if \a arrival is empty. Only the bin
+ * boundaries need to be in place, so it partitions at each of them instead
+ * of sorting.
+ *
+ * \param rank the (contri, index) of the blocks, reordered so that the
+ * blocks of each channel follow those of the one before
+ * \param num_final the blocks ending a push, not in \a rank, that go over
+ * tcp anyway
+ * \param shuffle assign the channels at random instead
+ * \return where each udp channel starts in \a rank, channel c at [c-1]
+ */
+inline std::vector<int> RankChannels(std::vector<Message_RU>* rank, int num_final, int C,
+                                     float k, const std::vector<float>& arrival, bool shuffle) {
+  if (shuffle) {
+    auto engine = std::default_random_engine{};
+    std::shuffle(rank->begin(), rank->end(), engine);
+  }
+  int max_index = rank->size();
+  int min_index = std::min<int>(std::round(k*(max_index+num_final)), max_index);
+  if (C <= 0) min_index = max_index;
+  std::vector<int> cuts(1, min_index);
+  if (min_index < max_index) {
+    // a lossy channel keeps a few blocks so that it is still measured
+    const float min_arrival = 0.05;
+    std::vector<float> weight(C, 1.0);
+    float weight_sum = 0.0;
+    for (int i = 0; i < C; ++i) {
+      if (i+1 < static_cast<int>(arrival.size())) weight[i] = std::max(arrival[i+1], min_arrival);
+      weight_sum += weight[i];
+    }
+    float acc = 0.0;
+    for (int i = 1; i <= C; ++i) {
+      acc += weight[i-1];
+      float bound = min_index + acc * (max_index-min_index) / weight_sum;
+      cuts.push_back(std::min<int>(std::ceil(bound), max_index));
+    }
+  }
+  if (!shuffle) {
+    auto begin = rank->begin();
+    for (int cut : cuts) {
+      if (cut > 0 && cut < max_index && begin < rank->begin() + cut) {
+        std::nth_element(begin, rank->begin() + cut, rank->end(),
+                         [](const Message_RU& a, const Message_RU& b) {
+                           return a.contri > b.contri;
+                         });
+        begin = rank->begin() + cut;
+      }
+    }
+  }
+  return cuts;
+}
+
+/**
+ * \brief assign the DGT blocks of a push to channels by their contri, see
+ * \ref RankChannels. The last block ends the push and always goes over tcp,
+ * last.
+ *
+ * \param rank scratch space for the (contri, index) of the blocks
+ * \param order filled with the block indices in sending order
+ */
+inline void AssignChannels(std::vector<Message>& blocks, int C, float k,
+                           const std::vector<float>& arrival, bool shuffle,
+                           std::vector<Message_RU>* rank, std::vector<int>* order) {
+  order->clear();
+  if (blocks.empty()) return;
+  int max_index = blocks.size() - 1;
+  rank->resize(max_index);
+  for (int j = 0; j < max_index; ++j) {
+    (*rank)[j].index = j;
+    (*rank)[j].contri = blocks[j].contri;
+  }
+  std::vector<int> cuts = RankChannels(rank, 1, C, k, arrival, shuffle);
+  int channel = 0;
+  for (int r = 0; r < max_index; ++r) {
+    while (channel < static_cast<int>(cuts.size()) && r >= cuts[channel]) ++channel;
+    int j = (*rank)[r].index;
+    blocks[j].meta.channel = channel;
+    order->push_back(j);
+  }
+  blocks[max_index].meta.channel = 0;
+  order->push_back(max_index);
+}
+
+/**
+ * \brief the DGT block size of a key of \a total_bytes, DGT_BLOCK_COUNT
+ *
+ * Aims at \a count blocks per key, but keeps a block at least \a min_bytes,
+ * so that the meta of small keys stays small next to their values, and at
+ * most \a room bytes, what a udp datagram leaves next to the meta of a block,
+ * see \ref BlockRoom. Always a whole number of floats.
+ */
+inline int AutoBlockSize(int total_bytes, int count, int min_bytes, int room) {
+  int size = (total_bytes + count - 1) / count;
+  size = std::min(std::max(size, min_bytes), room);
+  size -= size % sizeof(float);
+  return std::max<int>(size, sizeof(float));
+}
+
+/**
+ * \brief what a datagram of \a max_datagram bytes, DGT_UDP_MAX_DATAGRAM,
+ * leaves for the values of a block of \a msg_type next to its meta. the van
+ * must be started
+ */
+inline int BlockRoom(int msg_type, int num_channels, int max_datagram) {
+  int overhead = Postoffice::Get()->van()->BlockOverhead(msg_type, num_channels);
+  CHECK_GE(max_datagram - overhead, static_cast<int>(sizeof(float)))
+      << "DGT_UDP_MAX_DATAGRAM = " << max_datagram << " leaves no room next to the "
+      << overhead << " bytes of meta of a block";
+  return max_datagram - overhead;
+}
+
 /**
  * \brief the structure for a list of key-value pairs
  *
@@ -115,14 +237,33 @@ class KVWorker : public SimpleApp {
       enable_block = dmlc::GetEnv("DGT_ENABLE_BLOCK", 0);
       block_size = dmlc::GetEnv("DGT_BLOCK_SIZE", 0);
       test_block_size = block_size;
+      block_count_ = dmlc::GetEnv("DGT_BLOCK_COUNT", 0);
+      block_min_ = dmlc::GetEnv("DGT_BLOCK_MIN", 1024);
+      max_datagram_ = dmlc::GetEnv("DGT_UDP_MAX_DATAGRAM", 16 * 1024);
+      rank_window_bytes_ = dmlc::GetEnv("DGT_RANK_WINDOW_BYTES", 0);
+      rank_window_us_ = dmlc::GetEnv("DGT_RANK_WINDOW_US", 1000);
+      publish_ = dmlc::GetEnv("DGT_PUBLISH", 0);
       enable_dgt = dmlc::GetEnv("ENABLE_DGT", 0);
       clear_zero = dmlc::GetEnv("CLEAR_ZERO", 0); //
 //      std::cout << "node-1 set_random = " << set_random << " dgt_info = "<<dgt_info<< " enable_block = " << enable_block<<" block_size = " << block_size << " enable_dgt = "<< enable_dgt << std::endl;
 //init_dgt();
+      if (enable_dgt && rank_window_bytes_ > 0) {
+        window_thread_ = std::thread(&KVWorker<Val>::Window_timer, this);
+      }
   }
 
   /** \brief deconstructor */
-  virtual ~KVWorker() { delete obj_; obj_ = nullptr; }
+  virtual ~KVWorker() {
+    if (window_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lk(window_mu_);
+        window_stop_ = true;
+      }
+      window_cond_.notify_one();
+      window_thread_.join();
+    }
+    delete obj_; obj_ = nullptr;
+  }
 
   /**
    * \brief Pushes a list of key-value pairs to all server nodes.
@@ -201,6 +342,7 @@ class KVWorker : public SimpleApp {
 //	  std::cout<<"Node-1 Pull!"<<std::endl;
     SArray<Key> skeys(keys);
     int ts = AddPullCB(skeys, vals, lens, cmd, cb);
+    if (publish_ && PullPublished(ts, skeys, cmd)) return ts;
     KVPairs<Val> kvs;
     kvs.keys = skeys;
     kvs.priority = priority;
@@ -298,6 +440,7 @@ class KVWorker : public SimpleApp {
       int ts = obj_->NewRequest(kServerGroup);
 #endif
     AddCallback(ts, cb);
+    if (publish_) CountPushes(keys);
     KVPairs<Val> kvs;
     kvs.keys = keys;
     kvs.vals = vals;
@@ -327,6 +470,7 @@ class KVWorker : public SimpleApp {
             int priority = 0) {
 //	std::cout<<"Node-1 keys ZPull "<<DebugStr(keys.data(), keys.size())<<std::endl;
     int ts = AddPullCB(keys, vals, lens, cmd, cb);
+    if (publish_ && PullPublished(ts, keys, cmd)) return ts;
     KVPairs<Val> kvs;
     kvs.keys = keys;
     kvs.priority = priority;
@@ -351,6 +495,7 @@ class KVWorker : public SimpleApp {
                 int priority = 0) {
 //    std::cout<<"node-1 ZPushPull!"<<std::endl;
     int ts = AddPullCB(keys, outs, lens, cmd, cb);
+    if (publish_) CountPushes(keys);
     KVPairs<Val> kvs;
     kvs.keys = keys;
     kvs.vals = vals;
@@ -379,6 +524,41 @@ class KVWorker : public SimpleApp {
     CHECK(slicer); slicer_ = slicer;
   }
 
+  /**
+   * \brief report a scalar training signal, such as the loss. threadsafe.
+   *
+   * "loss" drives the adaptive K of DGT: once it has been reported, the
+   * legacy /tmp/loss<id>.csv file is no longer read. The last value of each
+   * signal is kept and can be read back with \ref GetSignal.
+   */
+  void ReportSignal(const std::string& name, float value) {
+    std::lock_guard<std::mutex> lk(signal_mu_);
+    signals_[name] = value;
+  }
+
+  /**
+   * \brief the last value reported for a signal. threadsafe.
+   * \return false if \a name was never reported
+   */
+  bool GetSignal(const std::string& name, float* value) {
+    std::lock_guard<std::mutex> lk(signal_mu_);
+    auto it = signals_.find(name);
+    if (it == signals_.end()) return false;
+    *value = it->second;
+    return true;
+  }
+
+  /**
+   * \brief key -> the DGT block size its pushes are cut into, for the keys
+   * pushed so far. threadsafe
+   */
+  std::unordered_map<int, int> GetBlockSizes() {
+    std::lock_guard<std::mutex> lk(key_block_mu_);
+    std::unordered_map<int, int> sizes;
+    for (const auto& it : key_block_) sizes[it.first] = it.second.block_size;
+    return sizes;
+  }
+
  private:
   /**
    * \brief internal pull, C/D can be either SArray or std::vector
@@ -419,6 +599,51 @@ class KVWorker : public SimpleApp {
 
   /** \brief data buffer for received kvs for each timestamp */
   std::unordered_map<int, std::vector<KVPairs<Val>>> recv_kvs_;
+  /** \brief count a push of each key, the versions a pull of them waits for */
+  void CountPushes(const SArray<Key>& keys);
+  /**
+   * \brief complete the pull \a ts from the values the servers published,
+   * now or once they include all the pushes of this worker
+   * \return false if a key was never published, the pull is sent then
+   */
+  bool PullPublished(int ts, const SArray<Key>& keys, int cmd);
+  /** \brief keep the values of a publish, running the pulls waiting for them */
+  void HandlePublish(const Message& msg);
+  /**
+   * \brief keep the values of a pushpull response as published, the server
+   * does not publish what every worker pushpulled
+   */
+  void KeepPushPulled(const Message& msg);
+  /**
+   * \brief keep \a kvs of a single key as its values published, including
+   * \a version pushes of this worker
+   * \param known only keep it if the servers publish the key already
+   */
+  void KeepPublished(const KVPairs<Val>& kvs, int version, int cmd, bool known);
+  /** \brief a pull of published keys, and the pushes its values must include */
+  struct WaitingPull {
+    int ts;
+    SArray<Key> keys;
+    std::vector<int> versions;
+  };
+  /** \brief the published values of a pull if they are recent enough. publish_mu_ held */
+  bool Published(const WaitingPull& pull, std::vector<KVPairs<Val>>* kvs);
+  /** \brief run the pull callback of \a ts on \a kvs and mark it done */
+  void FinishPull(int ts, std::vector<KVPairs<Val>>* kvs);
+  /** \brief complete pulls from the values servers publish, DGT_PUBLISH */
+  int publish_ = 0;
+  /** \brief the last values published of a key */
+  struct PublishedKV {
+    /** pushes of this worker the values include */
+    int version = 0;
+    int cmd = 0;
+    KVPairs<Val> kvs;
+  };
+  std::unordered_map<Key, PublishedKV> published_;
+  /** \brief key -> the pushes of this worker */
+  std::unordered_map<Key, int> pushed_;
+  std::vector<WaitingPull> waiting_pulls_;
+  std::mutex publish_mu_;
   /** \brief callbacks for each timestamp */
 #ifdef EVAL_CONTRIBUTE_CON
         void Open_loss_file();
@@ -436,17 +661,107 @@ class KVWorker : public SimpleApp {
         int   adaptive_k_flag = 0;
         int udp_channel_num = 0;
         int enable_send_drop = 0;
+        /** \brief block indices in the order Rank_blocks wants them sent */
         std::vector<int> index_vec;
+        /** \brief server id -> per channel arrival ratio it measured, from its push responses */
+        std::unordered_map<int, std::vector<float>> channel_arrival_;
+        std::mutex arrival_mu_;
+        /** \brief arrival ratios of the server the current push goes to */
+        std::vector<float> arrival_vec;
+        /** \brief error feedback for the blocks lost on the udp channels, DGT_ERROR_FEEDBACK */
+        int error_feedback = 0;
+        struct Residual {
+          /** copy of the udp blocks of the push in flight */
+          std::vector<float> sent;
+          /** seq -> whether it is in sent */
+          std::vector<bool> on_udp;
+          int block_floats = 0;
+          /** what the server lost, added to the next push of the key */
+          std::vector<float> lost;
+        };
+        /** \brief key -> its residual */
+        std::unordered_map<int, Residual> residual_;
+        /** \brief (timestamp << 32 | server id) -> key of the push in flight */
+        std::unordered_map<uint64_t, int> inflight_;
+        std::mutex residual_mu_;
+        /**
+         * \brief the gradient about to be pushed plus the lost values of the
+         * key, in a copy owned by the push. \a vals itself if nothing was lost
+         */
+        SArray<Val> Apply_residual(int key, const SArray<Val>& vals);
+        /** \brief keep the udp blocks of a push until the server reports which it lost */
+        void Keep_residual(int key, int timestamp, int server,
+                           const std::vector<Message>& blocks, int block_bytes);
+        /** \brief move the blocks reported in \a msg.meta.missing_seq to the residual */
+        void Collect_residual(const Message& msg);
         void Update_loss_delta();
-        float Evaluate_msg_contri(int key, Message& msg);
+        float Evaluate_msg_contri(float* contri, const SArray<Val>& vals);
         float mse(int key, int block_size, SArray<Val>& vals);
         int Get_channel(int index, int max_index, int C, float k);
+        void Rank_blocks(std::vector<Message>& blocks, int C, float k,
+                         const std::vector<float>& arrival);
         int Aproximate_channel_estimate(Message& msg,int C);
-        void Update_contri_max(int key, int seq, int seq_end,float contri);
+        void Update_contri_max(int key, float contri);
         int64_t push_op_num = 0;
         int enable_block = 0;
         int block_size = 0;
         int test_block_size = 0;
+        /** \brief target number of blocks per key, 0 cuts every key at block_size, DGT_BLOCK_COUNT */
+        int block_count_ = 0;
+        /** \brief smallest block DGT_BLOCK_COUNT cuts, DGT_BLOCK_MIN */
+        int block_min_ = 1024;
+        /** \brief largest udp datagram, DGT_UDP_MAX_DATAGRAM */
+        int max_datagram_ = 16 * 1024;
+        /** \brief what max_datagram_ leaves for the values of a push block, set on the first one */
+        int block_room_ = 0;
+        struct KeyBlock {
+          int total_bytes = 0;
+          int block_size = 0;
+        };
+        /** \brief key -> the block size chosen for its size */
+        std::unordered_map<int, KeyBlock> key_block_;
+        std::mutex key_block_mu_;
+        /** \brief the block size of a push of \a key, chosen again if its size changed */
+        int Block_size(int key, int total_bytes);
+        /** \brief the blocks of a push waiting in the ranking window */
+        struct WindowPush {
+          int key;
+          int timestamp;
+          int server;
+          int block_bytes;
+          std::vector<Message> blocks;
+        };
+        /**
+         * \brief pushes ranked together across keys, DGT_RANK_WINDOW_BYTES.
+         * window_mu_ guards it and the window state below
+         */
+        std::vector<WindowPush> window_;
+        size_t window_bytes_ = 0;
+        /** \brief when the oldest push of the window came */
+        std::chrono::steady_clock::time_point window_start_;
+        float window_k_ = 1.0;
+        bool window_stop_ = false;
+        std::mutex window_mu_;
+        /** \brief held by Flush_window while it sends, so that windows go out in order */
+        std::mutex flush_mu_;
+        std::condition_variable window_cond_;
+        std::thread window_thread_;
+        /** \brief bytes of pushes that fill the window, 0 ranks each push alone, DGT_RANK_WINDOW_BYTES */
+        int rank_window_bytes_ = 0;
+        /** \brief longest a push waits in the window, DGT_RANK_WINDOW_US */
+        int rank_window_us_ = 1000;
+        /** \brief add the blocks in msg_vector to the window, flushing it once full */
+        void Window_push(int key, int timestamp, int server, int block_bytes, int total_bytes);
+        /**
+         * \brief take the window and rank the blocks of all its pushes together
+         * and send them, the last block of each push after the others. window_mu_
+         * is only held to take the window, not while ranking and sending
+         */
+        void Flush_window();
+        /** \brief thread function flushing the window once its oldest push waited long enough */
+        void Window_timer();
+        /** \brief tell the server how many blocks of a push each channel carries */
+        void Count_channels(std::vector<Message>& blocks, int C);
         int enable_dgt = 0;
         int clear_zero = 0;
         std::unordered_map<int, float> pre_max_N;
@@ -458,11 +773,14 @@ class KVWorker : public SimpleApp {
         float max_contri = 0.0;
         std::unordered_map<int, float> contri_max;
         std::unordered_map<int, float> pre_contri_max;
-        FILE *fp;
+        /** \brief legacy loss file, closed once the loss is reported in process */
+        FILE *fp = nullptr;
 
         std::unordered_map<int, float> p_loss;
-        std::unordered_map<int, std::unordered_map<int, float>> contri;
+        /** \brief key -> EMA contribution of each of its blocks, sized at the first push */
+        std::unordered_map<int, std::vector<float>> contri;
         std::vector<Message> msg_vector;
+        /** \brief (contri, index) of the blocks being ranked */
         std::vector<Message_RU> rank_vector;
         float pre_loss = 0;
         float delta_l = 0.0;
@@ -470,6 +788,10 @@ class KVWorker : public SimpleApp {
   std::unordered_map<int, Callback> callbacks_;
   /** \brief lock */
   std::mutex mu_;
+  /** \brief last value of each reported signal */
+  std::unordered_map<std::string, float> signals_;
+  /** \brief lock of signals_ */
+  std::mutex signal_mu_;
   /** \brief kv list slicer */
   Slicer slicer_;
 #ifdef DOUBLE_CHANNEL
@@ -505,6 +827,8 @@ struct KVMeta {
 #endif
   /** \brief the customer id of worker */
   int customer_id;
+  /** \brief the priority of the request, the response is sent with it */
+  int priority = 0;
 };
 
 /**
@@ -520,10 +844,28 @@ class KVServer : public SimpleApp {
   explicit KVServer(int app_id) : SimpleApp() {
     using namespace std::placeholders;
     obj_ = new Customer(app_id, app_id, std::bind(&KVServer<Val>::Process, this, _1));
+    dgt_pull_ = dmlc::GetEnv("DGT_PULL", 0);
+    pull_k_ = dmlc::GetEnv("DGT_PULL_K", 0.5);
+    pull_block_size_ = dmlc::GetEnv("DGT_BLOCK_SIZE", 0);
+    pull_block_count_ = dmlc::GetEnv("DGT_BLOCK_COUNT", 0);
+    pull_block_min_ = dmlc::GetEnv("DGT_BLOCK_MIN", 1024);
+    max_datagram_ = dmlc::GetEnv("DGT_UDP_MAX_DATAGRAM", 16 * 1024);
+    pull_channels_ = dmlc::GetEnv("DMLC_UDP_CHANNEL_NUM", 0);
+    publish_ = dmlc::GetEnv("DGT_PUBLISH", 0);
+    int num_threads = dmlc::GetEnv("DGT_SERVER_THREADS", 1);
+    for (int i = 0; num_threads > 1 && i < num_threads; ++i) {
+      queues_.emplace_back(new ThreadsafeQueue<Message>());
+      threads_.emplace_back(&KVServer<Val>::Receiving, this, i);
+    }
   }
 
   /** \brief deconstructor */
-  virtual ~KVServer() { delete obj_; obj_ = nullptr; }
+  virtual ~KVServer() {
+    delete obj_; obj_ = nullptr;
+    // an empty message stops a thread
+    for (auto& q : queues_) q->Push(Message());
+    for (auto& t : threads_) t.join();
+  }
 
   /**
    * \brief the handle to process a push/pull request from a worker
@@ -546,12 +888,65 @@ class KVServer : public SimpleApp {
    */
   void Response(const KVMeta& req, const KVPairs<Val>& res = KVPairs<Val>());
 
+  /**
+   * \brief send the new values of keys to every worker unasked, DGT_PUBLISH.
+   * a worker then completes its pulls of a key from the values last published,
+   * once they include all its pushes of the key, instead of sending them
+   * \param kv the keys, values and lens, one message for each key
+   * \param cmd the command the workers pull the keys with
+   */
+  void Publish(const KVPairs<Val>& kv, int cmd = 0);
+
  private:
   /** \brief internal receive handle */
   void Process(const Message& msg);
+  /** \brief run the request handle on a data message */
+  void Handle(const Message& msg);
+  /** \brief thread function handling the keys of one queue */
+  void Receiving(int i);
+  /**
+   * \brief data messages by key, DGT_SERVER_THREADS of them. the request
+   * handle of a key always runs on the same thread, different keys at once.
+   * empty if it runs on the customer thread
+   */
+  std::vector<std::unique_ptr<ThreadsafeQueue<Message>>> queues_;
+  std::vector<std::thread> threads_;
   /** \brief request handle */
   ReqHandle request_handle_;
     std::unordered_map<int,int> tag_map;
+  /**
+   * \brief send a single key pull response as DGT blocks, ranked by how much
+   * each block changed since the last pull of that worker
+   */
+  void ResponsePull(const Meta& head, const KVPairs<Val>& res);
+  /** \brief DGT for pull responses, DGT_PULL */
+  int dgt_pull_ = 0;
+  /** \brief share of the pull blocks sent over tcp, DGT_PULL_K */
+  float pull_k_ = 0.5;
+  int pull_block_size_ = 0;
+  /** \brief the blocks of a pull are sized like the pushes of the key, see \ref AutoBlockSize */
+  int pull_block_count_ = 0;
+  int pull_block_min_ = 1024;
+  int max_datagram_ = 16 * 1024;
+  /** \brief what max_datagram_ leaves for the values of a pull block, set on the first one */
+  int pull_room_ = 0;
+  int pull_channels_ = 0;
+  /** \brief what a worker was last sent of a key */
+  struct PullState {
+    std::vector<float> sent;
+    /** number of pulls, stamped on the blocks as push_op_num */
+    int num = 0;
+  };
+  /** \brief (worker << 32 | key) -> its state */
+  std::unordered_map<uint64_t, PullState> pull_state_;
+  std::mutex pull_mu_;
+  /** \brief count the pushes of every worker for \ref Publish, DGT_PUBLISH */
+  int publish_ = 0;
+  /** \brief (worker << 32 | key) -> the pushes received */
+  std::unordered_map<uint64_t, int> pushes_;
+  /** \brief worker -> the customer its requests come from */
+  std::unordered_map<int, int> worker_customer_;
+  std::mutex publish_mu_;
 };
 
 
@@ -591,6 +986,32 @@ void KVServer<Val>::Process(const Message& msg) {
   if (msg.meta.simple_app) {
     SimpleApp::Process(msg); return;
   }
+  if (queues_.size() && msg.data.size()) {
+    SArray<Key> keys(msg.data[0]);
+    Key key = keys[0];
+    // a compressed push leads with a dummy key of len 0 for the original
+    // size, its pulls go by the data key after it
+    if (keys.size() == 2 && msg.data.size() > 2 && SArray<int>(msg.data[2])[0] == 0) {
+      key = keys[1];
+    }
+    queues_[key % queues_.size()]->Push(msg);
+    return;
+  }
+  Handle(msg);
+}
+
+template <typename Val>
+void KVServer<Val>::Receiving(int i) {
+  while (true) {
+    Message msg;
+    queues_[i]->WaitAndPop(&msg);
+    if (msg.data.empty()) break;
+    Handle(msg);
+  }
+}
+
+template <typename Val>
+void KVServer<Val>::Handle(const Message& msg) {
   KVMeta meta;
   meta.cmd       = msg.meta.head;
   meta.push      = msg.meta.push;
@@ -598,6 +1019,7 @@ void KVServer<Val>::Process(const Message& msg) {
   meta.sender    = msg.meta.sender;
   meta.timestamp = msg.meta.timestamp;
   meta.customer_id = msg.meta.customer_id;
+  meta.priority  = msg.meta.priority;
   KVPairs<Val> data;
   int n = msg.data.size();
   if (n) {
@@ -610,10 +1032,60 @@ void KVServer<Val>::Process(const Message& msg) {
       CHECK_EQ(data.lens.size(), data.keys.size());
     }
   }
+  // once for each push, the DGT blocks of a push end with the seq_end one
+  if (publish_ && meta.push && msg.meta.seq == msg.meta.seq_end) {
+    std::lock_guard<std::mutex> lk(publish_mu_);
+    worker_customer_[meta.sender] = meta.customer_id;
+    for (Key key : data.keys) {
+      ++pushes_[(static_cast<uint64_t>(meta.sender) << 32) | static_cast<uint32_t>(key)];
+    }
+  }
   CHECK(request_handle_);
   request_handle_(meta, data, this);
 }
 
+template <typename Val>
+void KVServer<Val>::Publish(const KVPairs<Val>& kv, int cmd) {
+  CHECK(publish_) << "set DGT_PUBLISH on every node to publish";
+  CHECK(kv.lens.empty() || kv.lens.size() == kv.keys.size());
+  size_t offset = 0;
+  for (size_t i = 0; i < kv.keys.size(); ++i) {
+    size_t len = kv.lens.empty() ? kv.vals.size() / kv.keys.size() : kv.lens[i];
+    CHECK_LE(offset + len, kv.vals.size());
+    SArray<Key> keys = kv.keys.segment(i, i + 1);
+    SArray<Val> vals = kv.vals.segment(offset, offset + len);
+    SArray<int> lens = {static_cast<int>(len)};
+    offset += len;
+    for (int id : Postoffice::Get()->GetNodeIDs(kWorkerGroup)) {
+      Message msg;
+      {
+        std::lock_guard<std::mutex> lk(publish_mu_);
+        auto it = worker_customer_.find(id);
+        // a worker that never pushed to this server does not wait for it
+        if (it == worker_customer_.end()) continue;
+        msg.meta.customer_id = it->second;
+        msg.meta.push_op_num =
+            pushes_[(static_cast<uint64_t>(id) << 32) | static_cast<uint32_t>(kv.keys[i])];
+      }
+      msg.meta.app_id = obj_->app_id();
+      // a request, so that the worker does not count it as a response
+      msg.meta.request = true;
+      msg.meta.push = false;
+      msg.meta.pull = true;
+      msg.meta.head = cmd;
+      msg.meta.msg_type = 6;
+      msg.meta.recver = id;
+      msg.AddData(keys);
+      msg.meta.keys_len = msg.data.back().size();
+      msg.AddData(vals);
+      msg.meta.vals_len = msg.data.back().size();
+      msg.AddData(lens);
+      msg.meta.lens_len = msg.data.back().size();
+      Postoffice::Get()->van()->Send(msg);
+    }
+  }
+}
+
 template <typename Val>
 void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
   Message msg;
@@ -625,6 +1097,11 @@ void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
   msg.meta.head        = req.cmd;
   msg.meta.timestamp   = req.timestamp;
   msg.meta.recver      = req.sender;
+  msg.meta.priority    = req.priority;
+  if (dgt_pull_ && req.pull && !req.push && res.keys.size() == 1) {
+    ResponsePull(msg.meta, res);
+    return;
+  }
   if (res.keys.size()) {
     msg.AddData(res.keys);
     msg.meta.keys_len = msg.data.back().size();
@@ -638,6 +1115,80 @@ void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
   Postoffice::Get()->van()->Send(msg);
 }
 
+template <typename Val>
+void KVServer<Val>::ResponsePull(const Meta& head, const KVPairs<Val>& res) {
+  size_t total = res.vals.size() * sizeof(Val);
+  size_t n = total / sizeof(float);
+  uint64_t id = (static_cast<uint64_t>(head.recver) << 32) |
+      static_cast<uint32_t>(res.keys[0]);
+  PullState* st;
+  {
+    // a worker pulls a key once at a time, only the map needs the lock
+    std::lock_guard<std::mutex> lk(pull_mu_);
+    st = &pull_state_[id];
+    if (pull_block_count_ > 0 && pull_room_ == 0) {
+      pull_room_ = BlockRoom(5, pull_channels_, max_datagram_);
+    }
+  }
+  // the first pull goes whole over tcp, so that the worker has a copy to
+  // keep for the blocks lost later
+  size_t block = pull_block_count_ > 0 ?
+      AutoBlockSize(total, pull_block_count_, pull_block_min_, pull_room_) : pull_block_size_;
+  bool whole = st->sent.size() != n || block == 0 || total <= block;
+  int seq_num = whole ? 1 : (total + block - 1) / block;
+  if (whole) block = total;
+  ++st->num;
+  const float* vals = reinterpret_cast<const float*>(res.vals.data());
+  std::vector<Message> blocks(seq_num);
+  for (int seq = 0; seq < seq_num; ++seq) {
+    Message& msg = blocks[seq];
+    size_t offset = seq * block;
+    size_t len = std::min(block, total - offset);
+    msg.meta = head;
+    msg.meta.msg_type = 5;
+    msg.meta.first_key = res.keys[0];
+    msg.meta.seq = seq;
+    msg.meta.seq_begin = 0;
+    msg.meta.seq_end = seq_num - 1;
+    msg.meta.val_bytes = offset;
+    msg.meta.total_bytes = total;
+    msg.meta.push_op_num = st->num;
+    msg.AddData(res.keys);
+    msg.meta.keys_len = msg.data.back().size();
+    msg.AddData(res.vals.segment(offset / sizeof(Val), (offset + len) / sizeof(Val)));
+    msg.meta.vals_len = msg.data.back().size();
+    if (res.lens.size()) {
+      msg.AddData(res.lens);
+      msg.meta.lens_len = msg.data.back().size();
+    }
+    // how far the block moved since the worker last surely got it
+    float delta = 0;
+    if (!whole) {
+      const float* cur = vals + offset / sizeof(float);
+      const float* sent = st->sent.data() + offset / sizeof(float);
+      size_t m = len / sizeof(float);
+      for (size_t i = 0; i < m; ++i) delta += fabs(cur[i] - sent[i]);
+      if (m) delta /= m;
+    }
+    msg.contri = delta;
+  }
+  if (whole) st->sent.assign(vals, vals + n);
+  std::vector<Message_RU> rank;
+  std::vector<int> order;
+  AssignChannels(blocks, pull_channels_, pull_k_, std::vector<float>(), false, &rank, &order);
+  for (int j : order) {
+    int channel = blocks[j].meta.channel;
+    if (!whole && channel == 0) {
+      // only tcp is sure to arrive, a block lost on udp keeps its delta
+      // growing until it is ranked onto tcp
+      size_t offset = blocks[j].meta.val_bytes / sizeof(float);
+      size_t m = blocks[j].data[1].size() / sizeof(float);
+      std::copy(vals + offset, vals + offset + m, st->sent.begin() + offset);
+    }
+    Postoffice::Get()->van()->Classifier(std::move(blocks[j]), channel, 0);
+  }
+}
+
 template <typename Val>
 void KVWorker<Val>::DefaultSlicer(
     const KVPairs<Val>& send, const std::vector<Range>& ranges,
@@ -697,6 +1248,8 @@ void KVWorker<Val>::DefaultSlicer(
 #ifdef EVAL_CONTRIBUTE_CON
     template <typename Val>
     void KVWorker<Val>::Open_loss_file() {
+        float loss;
+        if(GetSignal("loss", &loss)) return;
         std::string file_str = "/tmp/loss"+ std::to_string(Postoffice::Get()->van()->my_node().id)+ ".csv";
         std::cout << "file_str = " << file_str << std::endl;
         fp = fopen(file_str.c_str(),"w+");
@@ -710,7 +1263,9 @@ void KVWorker<Val>::DefaultSlicer(
     void KVWorker<Val>::Update_loss_delta() {
         char line[10];
         float cur_loss = 0.0;
-        if(fgets(line, 10, fp) != NULL){
+        if(GetSignal("loss", &cur_loss)){
+            if(fp){ fclose(fp); fp = nullptr; }
+        }else if(fp && fgets(line, 10, fp) != NULL){
             cur_loss = atof(line);
             //std::cout << "loss = " << cur_loss << std::endl;
             fseek(fp,0,0);
@@ -728,6 +1283,23 @@ void KVWorker<Val>::DefaultSlicer(
         if(first_loss ==0.0){ first_loss = cur_loss;}
 #endif
     }
+    template <typename Val>
+    int KVWorker<Val>::Block_size(int key, int total_bytes) {
+        std::lock_guard<std::mutex> lk(key_block_mu_);
+        KeyBlock& b = key_block_[key];
+        if (b.block_size == 0 || b.total_bytes != total_bytes) {
+            if (block_count_ > 0 && block_room_ == 0) {
+                block_room_ = BlockRoom(2, udp_channel_num, max_datagram_);
+            }
+            b.total_bytes = total_bytes;
+            b.block_size = block_count_ > 0 ?
+                AutoBlockSize(total_bytes, block_count_, block_min_, block_room_) : block_size;
+            PS_VLOG(1) << "key " << key << " of " << total_bytes << " bytes goes in blocks of "
+                       << b.block_size;
+        }
+        return b.block_size;
+    }
+
     template <typename Val>
     float KVWorker<Val>::mse(int key, int block_size, SArray<Val>& vals) {
         int total_bytes = vals.size();
@@ -765,38 +1337,76 @@ void KVWorker<Val>::DefaultSlicer(
         std::cout << key << "," << mt/lt << std::endl;
     }
     template <typename Val>
-    void KVWorker<Val>::Update_contri_max(int key, int seq, int seq_end,float contri) {
-        if(contri_max.find(key)==contri_max.end() || seq == 0) contri_max[key] = 0.0;
-        if(pre_contri_max.find(key)==pre_contri_max.end()) pre_contri_max[key] = 0.0;
-        if(contri > contri_max[key]) contri_max[key] = contri;
-        //std::cout << "contri_max[" << key << "]" << contri_max[key] << std::endl;
-        if(seq == seq_end)  {
-
-            pre_contri_max[key] = contri_max[key];
-        }
-
+    void KVWorker<Val>::Update_contri_max(int key, float contri) {
+        /*max contri over the blocks of this push*/
+        contri_max[key] = contri;
+        pre_contri_max[key] = contri;
     }
     template <typename Val>
-    float KVWorker<Val>::Evaluate_msg_contri(int key, Message& msg) {
+    float KVWorker<Val>::Evaluate_msg_contri(float* contri, const SArray<Val>& vals) {
         /*calculate p_N of a msg*/
-        float *pd = (float*)msg.data[1].data();
-        int nlen = msg.data[1].size() / sizeof(float);
-        float N = 0.0;
-        for(int i = 0; i < nlen; i++){
-            N += fabs(*(pd+i));
-        }
+        const float *pd = reinterpret_cast<const float*>(vals.data());
+        int nlen = vals.size() * sizeof(Val) / sizeof(float);
+        float N = AbsSum(pd, nlen);
 
         /*calculate contri of a msg*/
-        auto itt = contri.find(key);
-        if(itt == contri.end()) contri[key][msg.meta.seq] = 0.0;
-        auto it = contri[key].find(msg.meta.seq);
-        if(it == contri[key].end()) contri[key][msg.meta.seq] = 0.0;
-
-        contri[key][msg.meta.seq] = contri_alpha * contri[key][msg.meta.seq] + (1-contri_alpha)*(N/nlen);
-        //if(key == 0 && msg.meta.seq == 0)
-        //std::cout << "contri[" << key << "][" << msg.meta.seq << "]" << contri[key][msg.meta.seq] << "," << N << "/" << nlen << " = " << N/nlen << std::endl;
-        Update_contri_max(key,msg.meta.seq,msg.meta.seq_end,contri[key][msg.meta.seq]);//////
-        return contri[key][msg.meta.seq];
+        *contri = contri_alpha * (*contri) + (1-contri_alpha)*(N/nlen);
+        return *contri;
+    }
+    template <typename Val>
+    SArray<Val> KVWorker<Val>::Apply_residual(int key, const SArray<Val>& vals) {
+        std::lock_guard<std::mutex> lk(residual_mu_);
+        auto it = residual_.find(key);
+        if(it == residual_.end()) return vals;
+        std::vector<float>& lost = it->second.lost;
+        size_t nlen = vals.size() * sizeof(Val) / sizeof(float);
+        SArray<Val> sum = vals;
+        if(lost.size() == nlen &&
+           std::any_of(lost.begin(), lost.end(), [](float v) { return v != 0; })){
+            // the caller's buffer may be an array the engine only lets us read
+            sum = SArray<Val>();
+            sum.CopyFrom(vals.data(), vals.size());
+            float *pd = reinterpret_cast<float*>(sum.data());
+            for(size_t i = 0; i < nlen; ++i) pd[i] += lost[i];
+        }
+        lost.assign(nlen, 0.0);
+        return sum;
+    }
+    template <typename Val>
+    void KVWorker<Val>::Keep_residual(int key, int timestamp, int server,
+                                      const std::vector<Message>& blocks, int block_bytes) {
+        std::lock_guard<std::mutex> lk(residual_mu_);
+        Residual& r = residual_[key];
+        if(blocks.empty()) return;
+        size_t nlen = blocks[0].meta.total_bytes / sizeof(float);
+        if(r.sent.size() != nlen) r.sent.resize(nlen);
+        r.block_floats = block_bytes / sizeof(float);
+        r.on_udp.assign(blocks.back().meta.seq_end + 1, false);
+        bool any = false;
+        for(const Message& block : blocks){
+            if(block.meta.channel == 0 || block.data.size() < 2) continue;
+            const SArray<char>& val = block.data[1];
+            memcpy(r.sent.data() + block.meta.val_bytes / sizeof(float), val.data(), val.size());
+            r.on_udp[block.meta.seq] = true;
+            any = true;
+        }
+        if(any) inflight_[(static_cast<uint64_t>(timestamp) << 32) | static_cast<uint32_t>(server)] = key;
+    }
+    template <typename Val>
+    void KVWorker<Val>::Collect_residual(const Message& msg) {
+        std::lock_guard<std::mutex> lk(residual_mu_);
+        auto it = inflight_.find((static_cast<uint64_t>(msg.meta.timestamp) << 32) |
+                                 static_cast<uint32_t>(msg.meta.sender));
+        if(it == inflight_.end()) return;
+        Residual& r = residual_[it->second];
+        inflight_.erase(it);
+        if(r.lost.size() != r.sent.size()) r.lost.assign(r.sent.size(), 0.0);
+        for(int seq : msg.meta.missing_seq){
+            if(seq < 0 || seq >= (int)r.on_udp.size() || !r.on_udp[seq]) continue;
+            size_t begin = static_cast<size_t>(seq) * r.block_floats;
+            size_t end = std::min(begin + r.block_floats, r.sent.size());
+            for(size_t i = begin; i < end; ++i) r.lost[i] += r.sent[i];
+        }
     }
     template <typename Val>
     int KVWorker<Val>::Aproximate_channel_estimate(Message& msg,int C) {
@@ -855,6 +1465,120 @@ void KVWorker<Val>::DefaultSlicer(
         return rand()%C+1;
         //return rn%7 + 1;
     }
+    template <typename Val>
+    void KVWorker<Val>::Rank_blocks(std::vector<Message>& blocks, int C, float k,
+                                    const std::vector<float>& arrival) {
+        AssignChannels(blocks, C, k, arrival, set_random, &rank_vector, &index_vec);
+        Count_channels(blocks, C);
+    }
+    template <typename Val>
+    void KVWorker<Val>::Count_channels(std::vector<Message>& blocks, int C) {
+        if(blocks.empty()) return;
+        std::vector<int>& sent = blocks.back().meta.channel_sent;
+        sent.assign(C+1, 0);
+        for(const Message& block : blocks) ++sent[block.meta.channel];
+    }
+    template <typename Val>
+    void KVWorker<Val>::Window_push(int key, int timestamp, int server, int block_bytes,
+                                    int total_bytes) {
+        std::unique_lock<std::mutex> lk(window_mu_);
+        if(window_.empty()) window_start_ = std::chrono::steady_clock::now();
+        window_.emplace_back();
+        WindowPush& push = window_.back();
+        push.key = key;
+        push.timestamp = timestamp;
+        push.server = server;
+        push.block_bytes = block_bytes;
+        push.blocks.swap(msg_vector);
+        window_k_ = dmlc_k;
+        window_bytes_ += total_bytes;
+        if(window_bytes_ < static_cast<size_t>(rank_window_bytes_)){
+            window_cond_.notify_one();
+            return;
+        }
+        lk.unlock();
+        Flush_window();
+    }
+    template <typename Val>
+    void KVWorker<Val>::Flush_window() {
+        std::lock_guard<std::mutex> flush_lk(flush_mu_);
+        std::vector<WindowPush> window;
+        float k;
+        {
+            std::lock_guard<std::mutex> lk(window_mu_);
+            window.swap(window_);
+            window_bytes_ = 0;
+            k = window_k_;
+        }
+        if(window.empty()) return;
+        // the bins follow the mean arrival ratios of the servers in the window
+        std::vector<float> arrival;
+        {
+            std::lock_guard<std::mutex> lk(arrival_mu_);
+            int n = 0;
+            for(const WindowPush& push : window){
+                auto it = channel_arrival_.find(push.server);
+                if(it == channel_arrival_.end()) continue;
+                if(arrival.size() < it->second.size()) arrival.resize(it->second.size(), 0.0);
+                for(size_t c = 0; c < it->second.size(); ++c) arrival[c] += it->second[c];
+                ++n;
+            }
+            for(float& a : arrival) a /= n;
+        }
+        std::vector<Message*> blocks;
+        std::vector<Message_RU> rank;
+        for(WindowPush& push : window){
+            for(size_t j = 0; j + 1 < push.blocks.size(); ++j){
+                rank.push_back({static_cast<int>(blocks.size()), push.blocks[j].contri});
+                blocks.push_back(&push.blocks[j]);
+            }
+        }
+        std::vector<int> cuts = RankChannels(&rank, window.size(), udp_channel_num,
+                                             k, arrival, set_random);
+        int channel = 0;
+        for(size_t r = 0; r < rank.size(); ++r){
+            while(channel < static_cast<int>(cuts.size()) && static_cast<int>(r) >= cuts[channel]) ++channel;
+            blocks[rank[r].index]->meta.channel = channel;
+        }
+        for(WindowPush& push : window){
+            if(push.blocks.empty()) continue;
+            push.blocks.back().meta.channel = 0;
+            Count_channels(push.blocks, udp_channel_num);
+            if(error_feedback){
+                Keep_residual(push.key, push.timestamp, push.server, push.blocks, push.block_bytes);
+            }
+        }
+        // every push still ends with its last block, so the server accepts it as before
+        for(const Message_RU& r : rank){
+            Message* block = blocks[r.index];
+            int c = block->meta.channel;
+            Postoffice::Get()->van()->Classifier(std::move(*block), c, 0);
+        }
+        for(WindowPush& push : window){
+            if(push.blocks.empty()) continue;
+            Postoffice::Get()->van()->Classifier(std::move(push.blocks.back()), 0, 0);
+        }
+    }
+    template <typename Val>
+    void KVWorker<Val>::Window_timer() {
+        std::unique_lock<std::mutex> lk(window_mu_);
+        while(!window_stop_){
+            if(window_.empty()){
+                window_cond_.wait(lk);
+                continue;
+            }
+            auto deadline = window_start_ + std::chrono::microseconds(rank_window_us_);
+            if(std::chrono::steady_clock::now() >= deadline){
+                lk.unlock();
+                Flush_window();
+                lk.lock();
+            }else{
+                window_cond_.wait_until(lk, deadline);
+            }
+        }
+        lk.unlock();
+        Flush_window();
+    }
 #ifdef ADAPTIVE_K
     template <typename Val>
     float KVWorker<Val>::adaptive_k(){
@@ -876,6 +1600,8 @@ void KVWorker<Val>::DefaultSlicer(
         dmlc_k_min = atof(CHECK_NOTNULL(Environment::Get()->find("DMLC_K_MIN")));
         adaptive_k_flag = atoi(CHECK_NOTNULL(Environment::Get()->find("ADAPTIVE_K_FLAG")));
         udp_channel_num = atoi(CHECK_NOTNULL(Environment::Get()->find("DMLC_UDP_CHANNEL_NUM")));
+        const char* ef = Environment::Get()->find("DGT_ERROR_FEEDBACK");
+        if(ef) error_feedback = atoi(ef);
         //enable_send_drop = atoi(CHECK_NOTNULL(Environment::Get()->find("ENABLE_SEND_DROP")));
         
         return;
@@ -914,6 +1640,8 @@ void KVWorker<Val>::Send(int timestamp, bool push, bool pull, int cmd, const KVP
   if ((size_t)skipped == sliced.size()) {
     RunCallback(timestamp);
   }
+  // the van sends the messages of higher priority first, DGT_SEND_PRIORITY
+  const int priority = kvs.priority;
 //std::cout<<"node-1 start to check 1"<<std::endl;
   for (size_t i = 0; i < sliced.size(); ++i) {
     const auto& s = sliced[i];
@@ -965,6 +1693,7 @@ std::cout << std::endl;
               msg.meta.head        = cmd;
               msg.meta.timestamp   = timestamp;
               msg.meta.recver      = Postoffice::Get()->ServerRankToID(i);
+              msg.meta.priority    = priority;
               msg.meta.msg_type = 1;
               msg.meta.first_key = kvs.keys[0];
               msg.meta.seq = 0;
@@ -994,15 +1723,20 @@ std::cout << std::endl;
               int seq = 0;
               int seq_num = 0;
 
-              if(enable_block == 0)
-                  block_size = total_bytes;
-              if(total_bytes % block_size == 0){
-                  seq_num = total_bytes/block_size;
+              int block_bytes = enable_block ? Block_size(kvs.keys[0], total_bytes)
+                                             : std::max(total_bytes, 1);
+              if(total_bytes % block_bytes == 0){
+                  seq_num = total_bytes/block_bytes;
               }else{
-                  seq_num = total_bytes/block_size + 1;
+                  seq_num = total_bytes/block_bytes + 1;
               }
               std::vector<int> count(udp_channel_num+1,0);
               int count_zero = 0;
+              const SArray<Val> vals = error_feedback ? Apply_residual(kvs.keys[0], kvs.vals)
+                                                      : kvs.vals;
+              std::vector<float>& key_contri = contri[kvs.keys[0]];
+              if(key_contri.size() != static_cast<size_t>(seq_num)) key_contri.assign(seq_num, 0.0);
+              float key_contri_max = 0.0;
               while(remain_bytes != 0){
                   Message msg;
                   msg.meta.app_id = obj_->app_id();
@@ -1013,12 +1747,13 @@ std::cout << std::endl;
                   msg.meta.head        = cmd;
                   msg.meta.timestamp   = timestamp;
                   msg.meta.recver      = Postoffice::Get()->ServerRankToID(i);
+                  msg.meta.priority    = priority;
                   msg.meta.msg_type = 2;
                   msg.meta.push_op_num = push_op_num;
                   msg.meta.total_bytes = total_bytes;
                   
-                  int l = std::min(remain_bytes,block_size);
-                  SArray<Val> tmp_val = kvs.vals.segment(val_bytes, val_bytes+l);
+                  int l = std::min(remain_bytes,block_bytes);
+                  SArray<Val> tmp_val = vals.segment(val_bytes, val_bytes+l);
                   ////////////////
                   //mse(kvs.keys[0],test_block_size,tmp_val);
                   //////////////////
@@ -1038,35 +1773,43 @@ std::cout << std::endl;
                           msg.meta.lens_len = msg.data.back().size();
                       }
                   }
-                  msg.contri = Evaluate_msg_contri((int)kvs.keys[0], msg);
-                  if(clear_zero){
-                      if(msg.contri != 0 || msg.meta.seq == msg.meta.seq_end) msg_vector.push_back(msg);
+                  msg.contri = Evaluate_msg_contri(&key_contri[seq], tmp_val);
+                  key_contri_max = std::max(key_contri_max, msg.contri);
+                  if(!clear_zero || msg.contri != 0 || msg.meta.seq == msg.meta.seq_end){
+                      msg_vector.push_back(std::move(msg));
                   }
-                  else
-                      msg_vector.push_back(msg);
                   remain_bytes -= l;
                   seq++;
-                  msg.data.clear();
 
 
               }
-              if(set_random){
-                  auto engine = std::default_random_engine{};
-                  std::shuffle(std::begin(msg_vector), std::end(msg_vector)-1, engine);
-              }else{
-                  std::sort(msg_vector.begin(),msg_vector.end()-1,[](const Message& msg1, const Message& msg2){
-                      return msg1.contri > msg2.contri;
-                  });
-              }
-              for(size_t j = 0; j < msg_vector.size(); ++j){
-                  msg_vector[j].meta.channel = Get_channel(j, msg_vector.size()-1, udp_channel_num, dmlc_k);
-                  if(msg_vector[j].meta.seq == msg_vector[j].meta.seq_end) {
-                      msg_vector[j].meta.channel=0;
+              Update_contri_max((int)kvs.keys[0], key_contri_max);
+              {
+                  std::lock_guard<std::mutex> lk(arrival_mu_);
+                  auto it = channel_arrival_.find(Postoffice::Get()->ServerRankToID(i));
+                  if(it != channel_arrival_.end()){
+                      arrival_vec = it->second;
+                  }else{
+                      arrival_vec.clear();
                   }
+              }
+              if(enable_dgt && rank_window_bytes_ > 0){
+                  Window_push(kvs.keys[0], timestamp, Postoffice::Get()->ServerRankToID(i),
+                              block_bytes, total_bytes);
+                  continue;
+              }
+              Rank_blocks(msg_vector, udp_channel_num, dmlc_k, arrival_vec);
+              if(error_feedback && enable_dgt){
+                  Keep_residual(kvs.keys[0], timestamp, Postoffice::Get()->ServerRankToID(i),
+                                msg_vector, block_bytes);
+              }
+              for(int j : index_vec){
+                  Message& block = msg_vector[j];
                   if(enable_dgt){
-                      Postoffice::Get()->van()->Classifier(msg_vector[j],msg_vector[j].meta.channel,0);
+                      int channel = block.meta.channel;
+                      Postoffice::Get()->van()->Classifier(std::move(block), channel, 0);
                   }else{
-                      Postoffice::Get()->van()->Send(msg_vector[j],0,0);
+                      Postoffice::Get()->van()->Send(block,0,0);
                   }
 
               }
@@ -1083,6 +1826,7 @@ std::cout << std::endl;
           msg.meta.head        = cmd;
           msg.meta.timestamp   = timestamp;
           msg.meta.recver      = Postoffice::Get()->ServerRankToID(i);
+          msg.meta.priority    = priority;
           msg.meta.msg_type = 3;
           msg.meta.first_key = kvs.keys[0];
           msg.meta.seq = 0;
@@ -1114,6 +1858,10 @@ void KVWorker<Val>::Process(const Message& msg) {
   if (msg.meta.simple_app) {
     SimpleApp::Process(msg); return;
   }
+  if (msg.meta.msg_type == 6) {
+    HandlePublish(msg); return;
+  }
+  if (publish_ && msg.meta.push && msg.meta.pull) KeepPushPulled(msg);
   // store the data for pulling
   int ts = msg.meta.timestamp;
 
@@ -1131,6 +1879,13 @@ void KVWorker<Val>::Process(const Message& msg) {
     recv_kvs_[ts].push_back(kvs);
     mu_.unlock();
   }
+#ifdef EVAL_CONTRIBUTE_CON
+  if (msg.meta.push && msg.meta.channel_arrival.size()) {
+    std::lock_guard<std::mutex> lk(arrival_mu_);
+    channel_arrival_[msg.meta.sender] = msg.meta.channel_arrival;
+  }
+  if (msg.meta.push && error_feedback) Collect_residual(msg);
+#endif
 #ifdef LITTLE_GRAIN_MSG_OFF
     if(msg.meta.push){
 		if (msg.meta.first_key == msg.meta.key_end)  {
@@ -1150,6 +1905,117 @@ void KVWorker<Val>::Process(const Message& msg) {
   }
 #endif
 }
+template <typename Val>
+void KVWorker<Val>::CountPushes(const SArray<Key>& keys) {
+  std::lock_guard<std::mutex> lk(publish_mu_);
+  for (Key key : keys) ++pushed_[key];
+}
+
+template <typename Val>
+bool KVWorker<Val>::PullPublished(int ts, const SArray<Key>& keys, int cmd) {
+  std::vector<KVPairs<Val>> kvs;
+  {
+    std::lock_guard<std::mutex> lk(publish_mu_);
+    WaitingPull pull;
+    pull.ts = ts;
+    pull.keys = keys;
+    for (Key key : keys) {
+      auto it = published_.find(key);
+      // the servers do not publish it, or not what this command pulls
+      if (it == published_.end() || it->second.cmd != cmd) return false;
+      pull.versions.push_back(pushed_[key]);
+    }
+    if (!Published(pull, &kvs)) {
+      waiting_pulls_.push_back(pull);
+      return true;
+    }
+  }
+  FinishPull(ts, &kvs);
+  return true;
+}
+
+template <typename Val>
+bool KVWorker<Val>::Published(const WaitingPull& pull, std::vector<KVPairs<Val>>* kvs) {
+  kvs->clear();
+  for (size_t i = 0; i < pull.keys.size(); ++i) {
+    const PublishedKV& p = published_[pull.keys[i]];
+    if (p.version < pull.versions[i]) return false;
+    kvs->push_back(p.kvs);
+  }
+  return true;
+}
+
+template <typename Val>
+void KVWorker<Val>::HandlePublish(const Message& msg) {
+  CHECK_EQ(msg.data.size(), (size_t)3) << "a publish carries keys, vals and lens";
+  KVPairs<Val> kvs;
+  kvs.keys = msg.data[0];
+  kvs.vals = msg.data[1];
+  kvs.lens = msg.data[2];
+  CHECK_EQ(kvs.keys.size(), (size_t)1) << "a publish carries a single key";
+  KeepPublished(kvs, msg.meta.push_op_num, msg.meta.head, false);
+}
+
+template <typename Val>
+void KVWorker<Val>::KeepPushPulled(const Message& msg) {
+  if (msg.data.size() < 3) return;
+  KVPairs<Val> res;
+  res.keys = msg.data[0];
+  res.vals = msg.data[1];
+  res.lens = msg.data[2];
+  if (res.lens.size() != res.keys.size()) return;
+  size_t offset = 0;
+  for (size_t i = 0; i < res.keys.size(); ++i) {
+    KVPairs<Val> kvs;
+    kvs.keys = res.keys.segment(i, i + 1);
+    kvs.vals = res.vals.segment(offset, offset + res.lens[i]);
+    kvs.lens = res.lens.segment(i, i + 1);
+    offset += res.lens[i];
+    int version;
+    {
+      std::lock_guard<std::mutex> lk(publish_mu_);
+      // the response includes this worker's push, the last one of the key
+      version = pushed_[res.keys[i]];
+    }
+    KeepPublished(kvs, version, msg.meta.head, true);
+  }
+}
+
+template <typename Val>
+void KVWorker<Val>::KeepPublished(const KVPairs<Val>& kvs, int version, int cmd, bool known) {
+  std::vector<std::pair<int, std::vector<KVPairs<Val>>>> ready;
+  {
+    std::lock_guard<std::mutex> lk(publish_mu_);
+    auto it = published_.find(kvs.keys[0]);
+    if (known && (it == published_.end() || it->second.cmd != cmd)) return;
+    PublishedKV& p = published_[kvs.keys[0]];
+    if (p.kvs.keys.size() && version < p.version) return;
+    p.version = version;
+    p.cmd = cmd;
+    p.kvs = kvs;
+    for (auto it = waiting_pulls_.begin(); it != waiting_pulls_.end(); ) {
+      std::vector<KVPairs<Val>> pulled;
+      if (Published(*it, &pulled)) {
+        ready.emplace_back(it->ts, std::move(pulled));
+        it = waiting_pulls_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  for (auto& r : ready) FinishPull(r.first, &r.second);
+}
+
+template <typename Val>
+void KVWorker<Val>::FinishPull(int ts, std::vector<KVPairs<Val>>* kvs) {
+  mu_.lock();
+  recv_kvs_[ts] = std::move(*kvs);
+  mu_.unlock();
+  RunCallback(ts);
+  // as if every server had responded
+  obj_->AddResponse(ts, Postoffice::Get()->num_servers());
+}
+
 template <typename Val>
 void KVWorker<Val>::RunCallback(int timestamp) {
   mu_.lock();
@@ -50,6 +50,7 @@ int Customer::NumResponse(int timestamp) {
 void Customer::AddResponse(int timestamp, int num) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
   tracker_[timestamp].second += num;
+  tracker_cond_.notify_all();
 }
 
 void Customer::Receiving() {
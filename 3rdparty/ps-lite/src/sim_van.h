@@ -0,0 +1,234 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_SIM_VAN_H_
+#define PS_SIM_VAN_H_
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+namespace ps {
+
+/**
+ * \brief ZMQ for the reliable channel, lossless unix datagram sockets standing
+ * in for the DGT udp channels, for repeatable experiments on one host
+ *
+ * The kernel never drops a unix datagram, a full receiver blocks its senders
+ * instead, so the only losses are the ones injected with DGT_UDP_DROP, drawn
+ * from DGT_UDP_FAULT_SEED per sender and channel. DGT_UDP_RATE,
+ * DGT_UDP_DELAY_US and DGT_UDP_JITTER_US give the bandwidth, latency and
+ * jitter of every channel. Together they make a run lose the same blocks
+ * every time.
+ *
+ * Channels are bound in the abstract namespace by port, so every node of a
+ * job must run on the same host with this van type.
+ */
+class SimVan : public ZMQVan {
+ public:
+  SimVan() {}
+  virtual ~SimVan() {
+    for (int fd : recv_fds_) close(fd);
+    if (send_fd_ >= 0) close(send_fd_);
+  }
+
+ protected:
+  void Start(int customer_id) override {
+    max_datagram_ = GetEnv("DGT_UDP_MAX_DATAGRAM", 16 * 1024);
+    ZMQVan::Start(customer_id);
+  }
+
+  void Stop() override {
+    ZMQVan::Stop();
+    std::lock_guard<std::mutex> lk(sim_mu_);
+    peers_.clear();
+  }
+
+  void WakeUDPReceivers() override {
+    // the sockets are closed on the next bind
+    std::lock_guard<std::mutex> lk(sim_mu_);
+    stopped_ = true;
+    for (int fd : recv_fds_) shutdown(fd, SHUT_RDWR);
+  }
+
+  std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
+    std::lock_guard<std::mutex> lk(sim_mu_);
+    for (int fd : recv_fds_) close(fd);
+    recv_fds_.clear();
+    stopped_ = false;
+    std::vector<int> ports;
+    for (size_t c = 0; c < node.udp_port.size(); ++c) {
+      int port = node.udp_port[c];
+      unsigned seed = static_cast<unsigned>(time(NULL) + port);
+      int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+      CHECK_GE(fd, 0) << "sim: create socket failed: " << strerror(errno);
+      for (int i = 0; i < max_retry + 1; ++i) {
+        struct sockaddr_un addr;
+        socklen_t len = Address(port, &addr);
+        if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), len) == 0) break;
+        if (i == max_retry) {
+          port = -1;
+        } else {
+          port = 10000 + rand_r(&seed) % 40000;
+        }
+      }
+      CHECK_NE(port, -1) << "sim: bind channel " << c + 1 << " failed";
+      recv_fds_.push_back(fd);
+      ports.push_back(port);
+    }
+    return ports;
+  }
+
+  void Connect_UDP(const Node& node) override {
+    CHECK_NE(node.id, node.kEmpty);
+    // worker doesn't need to connect to the other workers. same for server
+    if ((node.role == my_node_.role) && (node.id != my_node_.id)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lk(sim_mu_);
+    if (send_fd_ < 0) {
+      send_fd_ = socket(AF_UNIX, SOCK_DGRAM, 0);
+      CHECK_GE(send_fd_, 0) << "sim: create socket failed: " << strerror(errno);
+    }
+    peers_[node.id] = node.udp_port;
+  }
+
+  int SendMsg_UDP(int channel, Message& msg, int tag) override {
+    int id = msg.meta.recver;
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    {
+      std::lock_guard<std::mutex> lk(sim_mu_);
+      auto it = peers_.find(id);
+      if (it == peers_.end() || static_cast<size_t>(channel) >= it->second.size()) {
+        LOG(WARNING) << "sim: there is no channel " << channel + 1 << " to node " << id;
+        return -1;
+      }
+      addr_len = Address(it->second[channel], &addr);
+    }
+    int meta_size;
+    char* meta_buf;
+    PackMeta(msg.meta, &meta_buf, &meta_size);
+    std::vector<struct iovec> iov(2 + msg.data.size());
+    iov[0].iov_base = &meta_size;
+    iov[0].iov_len = sizeof(meta_size);
+    iov[1].iov_base = meta_buf;
+    iov[1].iov_len = meta_size;
+    size_t tot_bytes = sizeof(meta_size) + meta_size;
+    for (size_t i = 0; i < msg.data.size(); ++i) {
+      iov[2 + i].iov_base = msg.data[i].data();
+      iov[2 + i].iov_len = msg.data[i].size();
+      tot_bytes += msg.data[i].size();
+    }
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &addr;
+    mh.msg_namelen = addr_len;
+    mh.msg_iov = iov.data();
+    mh.msg_iovlen = iov.size();
+    while (!send_drop()) {
+      if (sendmsg(send_fd_, &mh, 0) >= 0) break;
+      if (errno == EINTR) continue;
+      CHECK_NE(errno, EMSGSIZE) << "sim: a block of " << tot_bytes
+                                << " bytes is larger than the socket buffer";
+      // the peer is gone, as a udp datagram would be
+      if (errno == ECONNREFUSED || errno == ENOENT) break;
+      LOG(WARNING) << "sim: failed to send message to node [" << id << "] errno: "
+                   << errno << " " << strerror(errno);
+      delete[] meta_buf;
+      return -1;
+    }
+    delete[] meta_buf;
+    udp_send_bytes_ += tot_bytes;
+    return tot_bytes;
+  }
+
+  int RecvMsg_UDP(int channel, Message* msg) override {
+    int fd;
+    {
+      std::lock_guard<std::mutex> lk(sim_mu_);
+      CHECK_LT(static_cast<size_t>(channel), recv_fds_.size());
+      fd = recv_fds_[channel];
+    }
+    msg->data.clear();
+    while (true) {
+      char* buf = new char[max_datagram_];
+      ssize_t size = recv(fd, buf, max_datagram_, MSG_TRUNC);
+      if (stopped_ || size == 0 || (size < 0 && errno != EINTR)) {
+        delete[] buf;
+        if (!stopped_) {
+          LOG(WARNING) << "sim: failed to receive message. errno: "
+                       << errno << " " << strerror(errno);
+        }
+        return -1;
+      }
+      int meta_size = 0;
+      if (size >= static_cast<ssize_t>(sizeof(meta_size))) memcpy(&meta_size, buf, sizeof(meta_size));
+      if (size < static_cast<ssize_t>(sizeof(meta_size)) || size > max_datagram_ ||
+          meta_size < 0 || sizeof(meta_size) + meta_size > static_cast<size_t>(size)) {
+        if (size > 0) {
+          LOG(WARNING) << "sim: drop a malformed or truncated datagram of "
+                       << size << " bytes on channel " << channel + 1
+                       << ", DGT_UDP_MAX_DATAGRAM = " << max_datagram_;
+        }
+        delete[] buf;
+        continue;
+      }
+      std::shared_ptr<char> holder(buf, [](char* p) { delete[] p; });
+      size_t offset = sizeof(meta_size);
+      if (!TryUnpackMeta(buf + offset, meta_size, &(msg->meta))) {
+        LOG(WARNING) << "sim: drop a datagram with a bad meta on channel " << channel + 1;
+        msg->meta = Meta();
+        continue;
+      }
+      offset += meta_size;
+      if (msg->meta.keys_len > 0) {
+        int lens[] = {msg->meta.keys_len, msg->meta.vals_len, msg->meta.lens_len};
+        int n = msg->meta.lens_len > 0 ? 3 : 2;
+        if (!DataFits(lens, n, offset, size)) {
+          LOG(WARNING) << "sim: drop a datagram of " << size << " bytes shorter than "
+                       << "its meta on channel " << channel + 1;
+          msg->meta = Meta();
+          continue;
+        }
+        for (int k = 0; k < n; ++k) {
+          SArray<char> data;
+          data.reset(buf + offset, lens[k], [holder](char*) { });
+          msg->data.push_back(data);
+          offset += lens[k];
+        }
+      }
+      return size;
+    }
+  }
+
+ private:
+  /** \brief the abstract unix address of a channel port */
+  static socklen_t Address(int port, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    std::string name = "ps-sim-" + std::to_string(port);
+    // a leading 0 puts the name in the abstract namespace, no file behind it
+    memcpy(addr->sun_path + 1, name.data(), name.size());
+    return offsetof(struct sockaddr_un, sun_path) + 1 + name.size();
+  }
+
+  /** \brief protects the sockets below */
+  std::mutex sim_mu_;
+  /** \brief shared by every channel, the address picks the channel */
+  int send_fd_ = -1;
+  /** \brief node_id to the port of each of its channels */
+  std::unordered_map<int, std::vector<int>> peers_;
+  /** \brief channel to its receiving socket, read by all its threads */
+  std::vector<int> recv_fds_;
+  std::atomic<bool> stopped_{false};
+  int max_datagram_ = 16 * 1024;
+};
+}  // namespace ps
+#endif  // PS_SIM_VAN_H_
@@ -0,0 +1,414 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_UDP_VAN_H_
+#define PS_UDP_VAN_H_
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ps/internal/mpsc_queue.h"
+namespace ps {
+
+/**
+ * \brief ZMQ for the reliable channel, batched plain udp sockets for the DGT
+ * channels
+ *
+ * Each udp channel is bound DGT_UDP_RECV_THREADS times on the same port with
+ * SO_REUSEPORT, so the kernel spreads the datagrams of different senders over
+ * that many receiving threads. A receiving thread drains its own socket with
+ * recvmmsg into pooled buffers which the received SArrays point into, and the
+ * Unimportant scheduler hands a whole batch of blocks to sendmmsg.
+ *
+ * The datagram is [meta_size, meta, data...], without the RADIO group header,
+ * so every node of a job must run the same van type.
+ */
+class UDPVan : public ZMQVan {
+ public:
+  UDPVan() {}
+  virtual ~UDPVan() {}
+
+ protected:
+  void Start(int customer_id) override {
+    recv_batch_ = std::max(1, GetEnv("DGT_UDP_RECV_BATCH", 32));
+    rcvbuf_ = GetEnv("DGT_UDP_RCVBUF", 64 * 1024 * 1024);
+    max_datagram_ = GetEnv("DGT_UDP_MAX_DATAGRAM", 16 * 1024);
+    ZMQVan::Start(customer_id);
+  }
+
+  void Stop() override {
+    ZMQVan::Stop();
+    std::lock_guard<std::mutex> lk(udp_mu_);
+    for (int fd : send_fds_) close(fd);
+    send_fds_.clear();
+    peers_.clear();
+  }
+
+  void WakeUDPReceivers() override {
+    std::lock_guard<std::mutex> lk(udp_mu_);
+    stopped_ = true;
+    for (auto& socks : recv_socks_) {
+      for (auto& s : socks) shutdown(s->fd, SHUT_RDWR);
+    }
+  }
+
+  std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
+    std::lock_guard<std::mutex> lk(udp_mu_);
+    recv_socks_.clear();
+    recv_socks_.resize(node.udp_port.size());
+    stopped_ = false;
+    ++generation_;
+    std::vector<int> ports;
+    for (size_t c = 0; c < node.udp_port.size(); ++c) {
+      int port = node.udp_port[c];
+      unsigned seed = static_cast<unsigned>(time(NULL) + port);
+      for (int i = 0; i < max_retry + 1; ++i) {
+        if (BindChannel(port, &recv_socks_[c])) break;
+        if (i == max_retry) {
+          port = -1;
+        } else {
+          port = 10000 + rand_r(&seed) % 40000;
+        }
+      }
+      CHECK_NE(port, -1) << "udp: bind channel " << c + 1 << " failed";
+      ports.push_back(port);
+    }
+    return ports;
+  }
+
+  void Connect_UDP(const Node& node) override {
+    CHECK_NE(node.id, node.kEmpty);
+    CHECK(node.hostname.size());
+    // worker doesn't need to connect to the other workers. same for server
+    if ((node.role == my_node_.role) && (node.id != my_node_.id)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lk(udp_mu_);
+    // one unconnected socket per channel, shared by all peers, so that a
+    // batch of blocks for different servers still goes out in one sendmmsg
+    for (size_t i = send_fds_.size(); i < node.udp_port.size(); ++i) {
+      int fd = socket(AF_INET, SOCK_DGRAM, 0);
+      CHECK_GE(fd, 0) << "udp: create socket failed: " << strerror(errno);
+      int tos = (node.udp_port.size() - i - 1) * 32;
+      setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+      int udp_send_buf_size = 16 * 1024 * 1024;
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &udp_send_buf_size, sizeof(udp_send_buf_size));
+      send_fds_.push_back(fd);
+    }
+    auto& addrs = peers_[node.id];
+    addrs.resize(node.udp_port.size());
+    for (size_t i = 0; i < node.udp_port.size(); ++i) {
+      Resolve(node.hostname, node.udp_port[i], &addrs[i]);
+      PS_VLOG(1) << "UDP[channel " << i + 1 << "]: " << node.hostname << ":"
+                 << node.udp_port[i] << " ready";
+    }
+  }
+
+  int SendMsg_UDP(int channel, Message& msg, int tag) override {
+    return SendChannel(channel, &msg, 1);
+  }
+
+  int SendMsgBatch_UDP(std::vector<Message>* msgs) override {
+    int send_bytes = 0;
+    size_t begin = 0;
+    while (begin < msgs->size()) {
+      // blocks of one channel go out together
+      int channel = (*msgs)[begin].meta.channel - 1;
+      size_t end = begin + 1;
+      while (end < msgs->size() && (*msgs)[end].meta.channel - 1 == channel) ++end;
+      int rc = SendChannel(channel, msgs->data() + begin, end - begin);
+      if (rc == -1) return -1;
+      send_bytes += rc;
+      begin = end;
+    }
+    if (Postoffice::Get()->verbose() >= 2) {
+      for (const auto& msg : *msgs) PS_VLOG(2) << msg.DebugString();
+    }
+    return send_bytes;
+  }
+
+  int RecvMsg_UDP(int channel, Message* msg) override {
+    RecvSock* s = ClaimRecvSock(channel);
+    msg->data.clear();
+    while (true) {
+      if (s->next == s->num && !Fill(s)) return -1;
+      int i = s->next++;
+      size_t size = s->hdrs[i].msg_len;
+      char* buf = s->bufs[i];
+      int meta_size = 0;
+      if (size >= sizeof(meta_size)) memcpy(&meta_size, buf, sizeof(meta_size));
+      if ((s->hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) || size < sizeof(meta_size) ||
+          meta_size < 0 || sizeof(meta_size) + meta_size > size) {
+        LOG(WARNING) << "udp: drop a malformed or truncated datagram of "
+                     << size << " bytes on channel " << channel + 1
+                     << ", DGT_UDP_MAX_DATAGRAM = " << max_datagram_;
+        continue;
+      }
+      // the buffer now belongs to the SArrays, it goes back to the pool once
+      // the last of them is released
+      s->bufs[i] = nullptr;
+      auto pool = s->pool;
+      std::shared_ptr<char> holder(buf, [pool](char* p) { pool->Put(p); });
+      size_t offset = sizeof(meta_size);
+      if (!TryUnpackMeta(buf + offset, meta_size, &(msg->meta))) {
+        LOG(WARNING) << "udp: drop a datagram with a bad meta on channel " << channel + 1;
+        msg->meta = Meta();
+        continue;
+      }
+      offset += meta_size;
+      if (msg->meta.keys_len > 0) {
+        int lens[] = {msg->meta.keys_len, msg->meta.vals_len, msg->meta.lens_len};
+        int n = msg->meta.lens_len > 0 ? 3 : 2;
+        if (!DataFits(lens, n, offset, size)) {
+          LOG(WARNING) << "udp: drop a datagram of " << size << " bytes shorter than "
+                       << "its meta on channel " << channel + 1;
+          msg->meta = Meta();
+          continue;
+        }
+        for (int k = 0; k < n; ++k) {
+          SArray<char> data;
+          data.reset(buf + offset, lens[k], [holder](char*) { });
+          msg->data.push_back(data);
+          offset += lens[k];
+        }
+      }
+      return size;
+    }
+  }
+
+ private:
+  /**
+   * \brief datagram buffers of one receiving socket. the receiving thread is
+   * the only one taking buffers, any thread may give them back
+   */
+  struct BufferPool {
+    explicit BufferPool(size_t size) : buf_size(size), free(2 * kMaxFree) { }
+    ~BufferPool() {
+      char* buf;
+      while (free.TryPop(&buf)) delete[] buf;
+    }
+    char* Get() {
+      char* buf;
+      return free.TryPop(&buf) ? buf : new char[buf_size];
+    }
+    void Put(char* buf) {
+      if (free.Size() < kMaxFree) {
+        free.Push(buf);
+      } else {
+        delete[] buf;
+      }
+    }
+    static const size_t kMaxFree = 1024;
+    size_t buf_size;
+    MPSCQueue<char*> free;
+  };
+
+  /** \brief one receiving socket of a channel and its recvmmsg batch */
+  struct RecvSock {
+    RecvSock(int fd, int batch, size_t buf_size)
+        : fd(fd), pool(std::make_shared<BufferPool>(buf_size)),
+          hdrs(batch), iovs(batch), bufs(batch, nullptr) { }
+    ~RecvSock() {
+      close(fd);
+      for (char* buf : bufs) delete[] buf;
+    }
+    int fd;
+    std::shared_ptr<BufferPool> pool;
+    std::vector<struct mmsghdr> hdrs;
+    std::vector<struct iovec> iovs;
+    std::vector<char*> bufs;
+    /** \brief datagrams in the last batch, and the next one to hand out */
+    int num = 0;
+    int next = 0;
+    std::atomic<bool> claimed{false};
+  };
+
+  /**
+   * \brief bind udp_recv_threads_ sockets on port
+   */
+  bool BindChannel(int port, std::vector<std::unique_ptr<RecvSock>>* socks) {
+    socks->clear();
+    for (int r = 0; r < udp_recv_threads_; ++r) {
+      int fd = socket(AF_INET, SOCK_DGRAM, 0);
+      CHECK_GE(fd, 0) << "udp: create socket failed: " << strerror(errno);
+      if (udp_recv_threads_ > 1) {
+        int one = 1;
+        CHECK_EQ(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)), 0)
+            << "udp: SO_REUSEPORT failed: " << strerror(errno);
+      }
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_, sizeof(rcvbuf_));
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      addr.sin_port = htons(port);
+      if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        socks->clear();
+        return false;
+      }
+      socks->emplace_back(new RecvSock(fd, recv_batch_, max_datagram_));
+    }
+    return true;
+  }
+
+  void Resolve(const std::string& hostname, int port, struct sockaddr_in* addr) {
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    int rc = getaddrinfo(hostname.c_str(), std::to_string(port).c_str(), &hints, &res);
+    CHECK_EQ(rc, 0) << "udp: failed to resolve " << hostname << ": " << gai_strerror(rc);
+    memcpy(addr, res->ai_addr, sizeof(*addr));
+    freeaddrinfo(res);
+  }
+
+  /**
+   * \brief the socket of channel served by the calling thread. every
+   * receiving thread claims a socket of its own on the first call
+   */
+  RecvSock* ClaimRecvSock(int channel) {
+    static thread_local RecvSock* mine = nullptr;
+    static thread_local int mine_generation = -1;
+    if (mine && mine_generation == generation_) return mine;
+    std::lock_guard<std::mutex> lk(udp_mu_);
+    CHECK_LT(static_cast<size_t>(channel), recv_socks_.size());
+    for (auto& s : recv_socks_[channel]) {
+      if (!s->claimed.exchange(true)) {
+        mine = s.get();
+        mine_generation = generation_;
+        return mine;
+      }
+    }
+    LOG(FATAL) << "udp: more receiving threads than sockets on channel " << channel + 1;
+    return nullptr;
+  }
+
+  /**
+   * \brief block until at least one datagram arrives, then take up to
+   * recv_batch_ of them in the same call
+   * \return false if the van is stopping or the socket failed
+   */
+  bool Fill(RecvSock* s) {
+    int batch = s->bufs.size();
+    for (int i = 0; i < batch; ++i) {
+      if (!s->bufs[i]) s->bufs[i] = s->pool->Get();
+      s->iovs[i].iov_base = s->bufs[i];
+      s->iovs[i].iov_len = s->pool->buf_size;
+      memset(&s->hdrs[i], 0, sizeof(s->hdrs[i]));
+      s->hdrs[i].msg_hdr.msg_iov = &s->iovs[i];
+      s->hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    s->num = s->next = 0;
+    while (true) {
+      int n = recvmmsg(s->fd, s->hdrs.data(), batch, MSG_WAITFORONE, nullptr);
+      if (stopped_) return false;
+      if (n > 0) {
+        s->num = n;
+        return true;
+      }
+      if (n < 0 && errno != EINTR) {
+        LOG(WARNING) << "udp: failed to receive message. errno: "
+                     << errno << " " << strerror(errno);
+        return false;
+      }
+    }
+  }
+
+  /**
+   * \brief send n blocks of one channel with as few sendmmsg calls as the
+   * kernel allows
+   */
+  int SendChannel(int channel, Message* msgs, size_t n) {
+    // only the socket and addresses are taken under the lock, the other
+    // channels and the peer registration go on during the send
+    int fd;
+    std::vector<struct sockaddr_in> addrs(n);
+    {
+      std::lock_guard<std::mutex> lk(udp_mu_);
+      CHECK_LT(static_cast<size_t>(channel), send_fds_.size());
+      fd = send_fds_[channel];
+      for (size_t i = 0; i < n; ++i) {
+        auto it = peers_.find(msgs[i].meta.recver);
+        if (it == peers_.end()) {
+          LOG(WARNING) << "udp: there is no socket to node " << msgs[i].meta.recver;
+          return -1;
+        }
+        addrs[i] = it->second[channel];
+      }
+    }
+    size_t num_iov = 0;
+    for (size_t i = 0; i < n; ++i) num_iov += 2 + msgs[i].data.size();
+    std::vector<struct iovec> iov(num_iov);
+    std::vector<struct mmsghdr> hdrs(n);
+    std::vector<char*> meta_bufs(n, nullptr);
+    std::vector<int> meta_sizes(n);
+    memset(hdrs.data(), 0, n * sizeof(struct mmsghdr));
+    size_t tot_bytes = 0;
+    int rc = 0;
+    struct iovec* v = iov.data();
+    for (size_t i = 0; i < n; ++i) {
+      PackMeta(msgs[i].meta, &meta_bufs[i], &meta_sizes[i]);
+      auto& mh = hdrs[i].msg_hdr;
+      mh.msg_name = &addrs[i];
+      mh.msg_namelen = sizeof(struct sockaddr_in);
+      mh.msg_iov = v;
+      mh.msg_iovlen = 2 + msgs[i].data.size();
+      v->iov_base = &meta_sizes[i];
+      v->iov_len = sizeof(int);
+      ++v;
+      v->iov_base = meta_bufs[i];
+      v->iov_len = meta_sizes[i];
+      ++v;
+      tot_bytes += sizeof(int) + meta_sizes[i];
+      for (auto& d : msgs[i].data) {
+        v->iov_base = d.data();
+        v->iov_len = d.size();
+        ++v;
+        tot_bytes += d.size();
+      }
+    }
+    size_t sent = 0;
+    while (rc == 0 && !send_drop() && sent < n) {
+      int k = sendmmsg(fd, hdrs.data() + sent, n - sent, 0);
+      if (k < 0) {
+        if (errno == EINTR) continue;
+        LOG(WARNING) << "udp: failed to send message to node [" << msgs[sent].meta.recver
+                     << "] errno: " << errno << " " << strerror(errno);
+        rc = -1;
+      } else {
+        sent += k;
+      }
+    }
+    for (char* buf : meta_bufs) delete[] buf;
+    if (rc == -1) return -1;
+    udp_send_bytes_ += tot_bytes;
+    return tot_bytes;
+  }
+
+  /** \brief protects the sockets below */
+  std::mutex udp_mu_;
+  /** \brief channel to the sending socket, carrying that channel's tos */
+  std::vector<int> send_fds_;
+  /** \brief node_id to the udp address of each of its channels */
+  std::unordered_map<int, std::vector<struct sockaddr_in>> peers_;
+  /** \brief channel to its SO_REUSEPORT group of receiving sockets */
+  std::vector<std::vector<std::unique_ptr<RecvSock>>> recv_socks_;
+  /** \brief bumped on every bind, so a thread never reuses a stale socket */
+  std::atomic<int> generation_{0};
+  std::atomic<bool> stopped_{false};
+  int recv_batch_ = 32;
+  int rcvbuf_ = 64 * 1024 * 1024;
+  int max_datagram_ = 16 * 1024;
+};
+}  // namespace ps
+#endif  // PS_UDP_VAN_H_
@@ -2,12 +2,17 @@
  *  Copyright (c) 2015 by Contributors
  */
 
+#include <algorithm>
 #include <chrono>
+#include <sstream>
+#include <string>
 #include <thread>
 
 #include "ps/base.h"
 #include "ps/internal/customer.h"
+#include "ps/internal/fec.h"
 #include "ps/internal/postoffice.h"
+#include "ps/internal/quantize.h"
 #include "ps/internal/van.h"
 #include "ps/sarray.h"
 
@@ -17,6 +22,10 @@
 #include "./resender.h"
 #include "./zmq_van.h"
 #include "./p3_van.h"
+#if defined(__linux__) && defined(DOUBLE_CHANNEL)
+#include "./udp_van.h"
+#include "./sim_van.h"
+#endif
 
 namespace ps {
 
@@ -26,11 +35,77 @@ namespace ps {
 // problem.
 static const int kDefaultHeartbeatInterval = 0;
 
+/**
+ * \brief the value of every udp channel in a comma separated environment
+ * variable, the last one applying to the remaining channels. empty if unset
+ */
+static std::vector<double> GetChannelEnv(const char* name, int num_channels) {
+  std::vector<double> values;
+  const char* env = Environment::Get()->find(name);
+  if (!env) return values;
+  std::stringstream ss(env);
+  std::string item;
+  double last = 0;
+  for (int i = 0; i < num_channels; ++i) {
+    if (std::getline(ss, item, ',')) last = atof(item.c_str());
+    values.push_back(last);
+  }
+  return values;
+}
+
+#ifdef UDP_CHANNEL
+/**
+ * \brief fixed layout meta of a DGT block, what PackMeta writes for
+ * msg_type 2 instead of the protobuf. It is followed by num_data_type data
+ * types of a byte each, num_compr floats and num_channel_sent ints
+ */
+struct BlockHeader {
+  /** kBlockMagic. its wire type is 6, so no protobuf starts with it */
+  uint8_t magic;
+  /** kBlockVersion, bumped on any change of the layout */
+  uint8_t version;
+  uint8_t flags;
+  uint8_t num_data_type;
+  uint8_t num_compr;
+  uint8_t num_channel_sent;
+  uint16_t channel;
+  int32_t head;
+  int32_t app_id;
+  int32_t customer_id;
+  int32_t timestamp;
+  int32_t tracker_num;
+  int32_t sender;
+  int32_t recver;
+  int32_t first_key;
+  int32_t seq;
+  int32_t seq_begin;
+  int32_t seq_end;
+  int32_t val_bytes;
+  int32_t total_bytes;
+  int32_t push_op_num;
+  int32_t keys_len;
+  int32_t vals_len;
+  int32_t lens_len;
+  int32_t priority;
+};
+static const uint8_t kBlockMagic = 0xde;
+static const uint8_t kBlockVersion = 1;
+enum BlockFlag {
+  kBlockRequest = 1, kBlockPush = 2, kBlockPull = 4, kBlockUDPReliable = 8
+};
+#endif
+
 Van* Van::Create(const std::string& type) {
   if (type == "zmq") {
     return new ZMQVan();
   } else if (type == "p3") {
     return new P3Van();
+#if defined(__linux__) && defined(DOUBLE_CHANNEL)
+  } else if (type == "udp") {
+    return new UDPVan();
+  } else if (type == "sim") {
+    return new SimVan();
+#endif
 #ifdef DMLC_USE_IBVERBS
 } else if (type == "ibverbs") {
     return new IBVerbsVan();
@@ -344,11 +419,299 @@ void Van::ProcessBarrierCommand(Message* msg) {
         return false;
     }
 
+static void AddBlock(char* dst, const SArray<char>& block) {
+  float* p = reinterpret_cast<float*>(dst);
+  const float* q = reinterpret_cast<const float*>(block.data());
+  for (size_t i = 0; i < block.size() / sizeof(float); ++i) p[i] += q[i];
+}
+
+bool Van::Reassemble(const Message& msg, Reassembly* r) {
+  size_t total = msg.meta.total_bytes;
+  int push = msg.meta.push_op_num;
+  int seq = msg.meta.seq;
+  const SArray<char>& block = msg.data[1];
+  if (msg.meta.val_bytes + block.size() > total) {
+    LOG(WARNING) << "drop block " << seq << " of key " << msg.meta.first_key
+                 << ", it is out of the pushed range";
+    return false;
+  }
+  if (push <= r->done_push) {
+    // a late block of an accepted push, its gradient goes into this push
+    if (static_cast<size_t>(seq) >= r->received.size() ||
+        r->bufs[r->cur].size() != total) {
+      // this push did not start yet or has another shape, keep it for later
+      r->late.push_back(msg);
+    } else if (r->received[seq]) {
+      AddBlock(r->bufs[r->cur].data() + msg.meta.val_bytes, block);
+    } else {
+      r->late.push_back(msg);
+    }
+    return false;
+  }
+  SArray<char>& buf = r->bufs[r->cur];
+  // a buffer still held by the push accepted two rounds ago is left to it
+  if (r->fresh && buf.ptr().use_count() > 1) buf = SArray<char>();
+  r->fresh = false;
+  if (buf.size() != total) buf = SArray<char>(total);
+  size_t num_seq = msg.meta.seq_end + 1;
+  if (r->received.size() != num_seq) {
+    r->received.assign(num_seq, 0);
+    r->num_received = 0;
+  }
+  // the same block again, e.g. one FEC rebuilt before the original came
+  if (r->received[seq]) return false;
+  char* dst = buf.data() + msg.meta.val_bytes;
+  memcpy(dst, block.data(), block.size());
+  r->received[seq] = push;
+  ++r->num_received;
+  for (auto it = r->late.begin(); it != r->late.end();) {
+    if (it->meta.seq == seq && it->meta.total_bytes == msg.meta.total_bytes) {
+      AddBlock(dst, it->data[1]);
+      it = r->late.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return true;
+}
+
+SArray<char> Van::FinishReassembly(const Message& last, Reassembly* r,
+                                   BlockStats* stats) {
+  SArray<char> buf = r->bufs[r->cur];
+  // every block but the last is val_bytes / seq_end long
+  size_t total = buf.size();
+  int seq_end = last.meta.seq_end;
+  size_t block_bytes = seq_end > 0 ? last.meta.val_bytes / seq_end : total;
+  const char* prev = nullptr;
+  if (missing_policy_ == 1) {
+    const Message& last_push = r->accepted;
+    if (last_push.data.size() > 1 && last_push.data[1].size() == total) {
+      prev = last_push.data[1].data();
+    }
+  }
+  size_t missing_bytes = 0;
+  r->missing.clear();
+  for (int seq = 0; seq < seq_end; ++seq) {
+    if (r->received[seq]) continue;
+    r->missing.push_back(seq);
+    size_t offset = seq * block_bytes;
+    size_t len = std::min(block_bytes, total - offset);
+    if (prev) {
+      memcpy(buf.data() + offset, prev + offset, len);
+    } else {
+      memset(buf.data() + offset, 0, len);
+    }
+    missing_bytes += len;
+    ++stats->missing;
+  }
+  if (missing_policy_ == 2 && missing_bytes > 0 && missing_bytes < total) {
+    // the missing blocks are zero, scaling everything keeps the sum unbiased
+    float scale = static_cast<float>(total) / (total - missing_bytes);
+    float* p = reinterpret_cast<float*>(buf.data());
+    for (size_t i = 0; i < total / sizeof(float); ++i) p[i] *= scale;
+  }
+  // the late blocks whose seq never came in this push
+  for (const Message& late : r->late) {
+    if (late.meta.total_bytes == total) AddBlock(buf.data() + late.meta.val_bytes, late.data[1]);
+  }
+  r->late.clear();
+  std::fill(r->received.begin(), r->received.end(), 0);
+  r->num_received = 0;
+  // the next push goes to the other buffer
+  r->cur ^= 1;
+  r->fresh = true;
+  return buf;
+}
+
+void Van::AcceptReassembly(Reassembly* r, BlockStats* stats) {
+  Message msg = std::move(r->last);
+  r->last = Message();
+  r->has_last = false;
+  msg.data[1] = FinishReassembly(msg, r, stats);
+  UpdateFeedback(msg, r);
+  r->done_push = msg.meta.push_op_num;
+  int done = r->done_push;
+  r->parity.erase(std::remove_if(r->parity.begin(), r->parity.end(),
+                                 [done](const Message& p) {
+                                   return p.meta.push_op_num <= done;
+                                 }), r->parity.end());
+  auto* obj = Postoffice::Get()->GetCustomer(msg.meta.app_id, msg.meta.app_id, 5);
+  CHECK(obj) << "timeout (5 sec) to wait App " << msg.meta.app_id << " ready";
+  obj->Accept(msg);
+  r->accepted = std::move(msg);
+}
+
+void Van::RecoverStripes(Reassembly* r, BlockStats* stats) {
+  int push = r->last.meta.push_op_num;
+  SArray<char>& buf = r->bufs[r->cur];
+  // the parities of this push by the first seq of their stripe
+  std::unordered_map<int, std::vector<Message*>> stripes;
+  for (auto& p : r->parity) {
+    if (p.meta.push_op_num == push && !p.meta.fec_seq.empty()) {
+      stripes[p.meta.fec_seq[0]].push_back(&p);
+    }
+  }
+  bool solved = false;
+  for (auto& it : stripes) {
+    std::vector<Message*>& parity = it.second;
+    const std::vector<int> seqs = parity[0]->meta.fec_seq;
+    size_t len = parity[0]->meta.val_bytes;
+    std::vector<int> lost;
+    bool valid = true;
+    for (size_t i = 0; i < seqs.size(); ++i) {
+      size_t seq = seqs[i];
+      if (seq >= r->received.size() || seq * len >= buf.size()) valid = false;
+      else if (r->received[seq] != push) lost.push_back(i);
+    }
+    if (!valid || lost.empty() || lost.size() > parity.size()) continue;
+    std::vector<int> rows;
+    std::vector<char*> blocks;
+    for (size_t l = 0; l < lost.size(); ++l) {
+      SArray<char>& p = parity[l]->data[1];
+      CHECK_EQ(p.size(), len) << "parity of key " << r->last.meta.first_key;
+      rows.push_back(parity[l]->meta.seq);
+      blocks.push_back(p.data());
+    }
+    // take the received blocks out of the parities, what is left are the lost ones
+    for (size_t i = 0; i < seqs.size(); ++i) {
+      if (r->received[seqs[i]] != push) continue;
+      size_t offset = seqs[i] * len;
+      for (size_t l = 0; l < rows.size(); ++l) {
+        ReedSolomon::MulAdd(ReedSolomon::Coef(rows[l], i), buf.data() + offset,
+                            std::min(len, buf.size() - offset), blocks[l]);
+      }
+    }
+    ReedSolomon::Solve(rows, lost, blocks, len);
+    for (size_t l = 0; l < lost.size(); ++l) {
+      int seq = seqs[lost[l]];
+      size_t offset = seq * len;
+      memcpy(buf.data() + offset, blocks[l], std::min(len, buf.size() - offset));
+      r->received[seq] = push;
+      ++r->num_received;
+      ++stats->recovered;
+    }
+    for (Message* p : parity) p->meta.fec_seq.clear();
+    solved = true;
+  }
+  if (solved) {
+    r->parity.erase(std::remove_if(r->parity.begin(), r->parity.end(),
+                                   [](const Message& p) { return p.meta.fec_seq.empty(); }),
+                    r->parity.end());
+  }
+}
+
+void Van::UpdateFeedback(const Message& last, Reassembly* r) {
+  std::lock_guard<std::mutex> lk(arrival_mu_);
+  if (!r->missing.empty()) {
+    uint64_t id = (static_cast<uint64_t>(last.meta.sender) << 32) |
+        static_cast<uint32_t>(last.meta.timestamp);
+    missing_[id].swap(r->missing);
+    r->missing.clear();
+  }
+  const std::vector<int>& sent = last.meta.channel_sent;
+  if (!sent.empty()) {
+    ChannelArrival& a = arrival_[last.meta.sender];
+    if (a.sent.size() < sent.size()) {
+      a.sent.resize(sent.size(), 0);
+      a.received.resize(sent.size(), 0);
+    }
+    for (size_t c = 0; c < a.sent.size(); ++c) {
+      int expected = c < sent.size() ? sent[c] : 0;
+      int got = c < r->channel_received.size() ? r->channel_received[c] : 0;
+      a.sent[c] = arrival_decay_ * a.sent[c] + expected;
+      a.received[c] = arrival_decay_ * a.received[c] + std::min(got, expected);
+    }
+  }
+  std::fill(r->channel_received.begin(), r->channel_received.end(), 0);
+}
+
+void Van::StampFeedback(Message* msg) {
+  std::lock_guard<std::mutex> lk(arrival_mu_);
+  if (!missing_.empty()) {
+    uint64_t id = (static_cast<uint64_t>(msg->meta.recver) << 32) |
+        static_cast<uint32_t>(msg->meta.timestamp);
+    auto m = missing_.find(id);
+    if (m != missing_.end()) {
+      msg->meta.missing_seq.swap(m->second);
+      missing_.erase(m);
+    }
+  }
+  auto it = arrival_.find(msg->meta.recver);
+  if (it == arrival_.end()) return;
+  const ChannelArrival& a = it->second;
+  msg->meta.channel_arrival.resize(a.sent.size());
+  for (size_t c = 0; c < a.sent.size(); ++c) {
+    msg->meta.channel_arrival[c] = a.sent[c] > 0 ? a.received[c] / a.sent[c] : 1.0;
+  }
+}
+
+void Van::Reassembly_timer() {
+  std::unique_lock<std::mutex> lk(timer_mu_);
+  while (!reassembly_stop_) {
+    pending_kick_ = false;
+    lk.unlock();
+    auto now = std::chrono::steady_clock::now();
+    auto next = now + std::chrono::seconds(1);
+    for (auto& shard : shards_) {
+      std::lock_guard<std::mutex> shard_lk(shard->mu);
+      std::vector<uint64_t>& pending = shard->pending;
+      size_t n = 0;
+      for (uint64_t id : pending) {
+        auto& r = shard->reassembly[id];
+        // accepted already, all of its blocks came in time
+        if (!r.has_last) continue;
+        if (r.deadline <= now) {
+          AcceptReassembly(&r, &shard->stats);
+          continue;
+        }
+        next = std::min(next, r.deadline);
+        pending[n++] = id;
+      }
+      pending.resize(n);
+    }
+    {
+      std::lock_guard<std::mutex> pull_lk(pull_copy_mu_);
+      size_t n = 0;
+      for (uint64_t id : pull_pending_) {
+        PullCopy& c = pull_copy_[id];
+        if (!c.has_last) continue;
+        if (c.deadline <= now) {
+          AcceptPull(&c);
+          continue;
+        }
+        next = std::min(next, c.deadline);
+        pull_pending_[n++] = id;
+      }
+      pull_pending_.resize(n);
+    }
+    lk.lock();
+    if (!pending_kick_ && !reassembly_stop_) pending_cond_.wait_until(lk, next);
+  }
+}
+
+Van::BlockStats Van::GetBlockStats() {
+  BlockStats total;
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lk(shard->mu);
+    const BlockStats& s = shard->stats;
+    if (total.on_time.size() < s.on_time.size()) {
+      total.on_time.resize(s.on_time.size(), 0);
+      total.on_time_bytes.resize(s.on_time.size(), 0);
+      total.late.resize(s.late.size(), 0);
+    }
+    for (size_t c = 0; c < s.on_time.size(); ++c) {
+      total.on_time[c] += s.on_time[c];
+      total.on_time_bytes[c] += s.on_time_bytes[c];
+      total.late[c] += s.late[c];
+    }
+    total.missing += s.missing;
+    total.recovered += s.recovered;
+  }
+  return total;
+}
+
 void Van::ProcessDataMsg(Message* msg) {
   // data msg
-#ifdef DOUBLE_CHANNEL
-    std::lock_guard<std::mutex> lk(mu_);
-#endif
   CHECK_NE(msg->meta.sender, Meta::kEmpty);
   CHECK_NE(msg->meta.recver, Meta::kEmpty);
   CHECK_NE(msg->meta.app_id, Meta::kEmpty);
@@ -359,71 +722,156 @@ void Van::ProcessDataMsg(Message* msg) {
   CHECK(obj) << "timeout (5 sec) to wait App " << app_id << " customer "
              << customer_id << " ready at " << my_node_.role;
 	 
-    if(my_node_.role == 0 && msg->meta.msg_type == 2){   //run only on server side
-        if(reconstruct){
-            if(msg_map[msg->meta.sender][msg->meta.first_key].find(msg->meta.seq) == msg_map[msg->meta.sender][msg->meta.first_key].end()){
-                msg_map[msg->meta.sender][msg->meta.first_key][msg->meta.seq] = *msg;
-            }else{
-                MergeMsg(&msg_map[msg->meta.sender][msg->meta.first_key][msg->meta.seq],msg);
-            }
-
-
-            if(msg->meta.seq == msg->meta.seq_end){
-                int ct = 0;
-                int cn = 0;
-                int push_t = 0;
-                int push_n = 0;
-                int cur_push = 0;
-
-                char* buf = (char *)malloc(msg->meta.total_bytes);
-                memset(buf,0,msg->meta.total_bytes);
-
-
-                /*********************************************************test*/
-                if(msg->meta.sender == 9)  ct += msg->meta.seq_end+1;
-                /*********************************************************/
-
-                for(auto &m : msg_map[msg->meta.sender][msg->meta.first_key]){
-                    /*********************************************************test*/
-                    if(msg->meta.sender == 9) {
-                        cn += 1;
-                        if(msg->meta.push_op_num-m.second.meta.push_op_num>0){
-                            push_t += msg->meta.push_op_num-m.second.meta.push_op_num;
-                            push_n += 1;
-                        }
-                        if(msg->meta.push_op_num-m.second.meta.push_op_num==0){
-                            cur_push += 1;
-                        }
-
-                    }
-                    /*********************************************************/
-
-                    memcpy(buf+m.second.meta.val_bytes, m.second.data[1].data(), m.second.data[1].size());
+    if(msg->meta.msg_type == 4){   //fec parity, only the server reassembly reads it
+        if(my_node_.role == 0 && reconstruct){
+            uint64_t id = (static_cast<uint64_t>(msg->meta.sender) << 32) |
+                static_cast<uint32_t>(msg->meta.first_key);
+            ReassemblyShard* shard = GetShard(msg->meta.first_key);
+            std::lock_guard<std::mutex> lk(shard->mu);
+            auto& r = shard->reassembly[id];
+            if(msg->meta.push_op_num > r.done_push){
+                r.parity.push_back(*msg);
+                if(r.has_last){
+                    RecoverStripes(&r, &shard->stats);
+                    if(r.num_received == r.received.size()) AcceptReassembly(&r, &shard->stats);
                 }
-                msg_map[msg->meta.sender][msg->meta.first_key].clear();
-                msg->data[1].reset(buf, msg->meta.total_bytes, [buf](char* p) {
-                    free(buf);
-                });
-
-                /*********************************************************test*/
-               /* if(msg->meta.sender == 9){
-
-	   
-                    std::cout << "push_op_num = " << msg->meta.push_op_num << ",key = " << msg->meta.first_key << ",cur_push rate =" << "("<< cur_push <<"/" << ct << ")"<< (float)cur_push/ct<<",complete rate = " << "("<< cn <<"/" << ct << ")"<<(float)cn/ct << ",delay avg iter = " << "("<< push_t <<"/" << push_n << ")"<<(float)push_t/push_n << ",tcp_recv = " << tcp_recv << ",udp_recv = " << udp_recv <<std::endl;
-                }*/
-                /*********************************************************/
-                obj->Accept(*msg);
-                msg_buffer[msg->meta.sender][msg->meta.first_key] = *msg;
-                // if(AsynAccept(msg)) obj->Accept(*msg);
             }
+        }
+        return;
+    }
+    if(my_node_.role == 0 && msg->meta.msg_type == 2 && reconstruct){   //run only on server side
+        // only the shard of the key is locked, the other receiving threads
+        // go on with the other keys
+        uint64_t id = (static_cast<uint64_t>(msg->meta.sender) << 32) |
+            static_cast<uint32_t>(msg->meta.first_key);
+        ReassemblyShard* shard = GetShard(msg->meta.first_key);
+        std::lock_guard<std::mutex> lk(shard->mu);
+        BlockStats& stats = shard->stats;
+        auto& r = shard->reassembly[id];
+        size_t channel = msg->meta.channel;
+        if(stats.on_time.size() <= channel){
+            stats.on_time.resize(channel+1, 0);
+            stats.on_time_bytes.resize(channel+1, 0);
+            stats.late.resize(channel+1, 0);
+        }
+        if(msg->meta.push_op_num <= r.done_push){
+            ++stats.late[channel];
+            // the worker already added it to its next push as a residual
+            if(error_feedback_) return;
         }else{
-            obj->Accept(*msg);
+            ++stats.on_time[channel];
+            if(msg->data.size() > 1) stats.on_time_bytes[channel] += msg->data[1].size();
+            if(r.channel_received.size() <= channel) r.channel_received.resize(channel+1, 0);
+            ++r.channel_received[channel];
         }
+        // a late or repeated block never finishes the push
+        if(!Reassemble(*msg, &r)) return;
+        if(msg->meta.seq == msg->meta.seq_end){
+            r.last = *msg;
+            r.has_last = true;
+            if(!r.parity.empty()) RecoverStripes(&r, &stats);
+            if(reassembly_deadline_us_ > 0 && r.num_received < r.received.size()){
+                // wait a while for the blocks still on the udp channels
+                r.deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(reassembly_deadline_us_);
+                shard->pending.push_back(id);
+                {
+                    std::lock_guard<std::mutex> timer_lk(timer_mu_);
+                    pending_kick_ = true;
+                }
+                pending_cond_.notify_one();
+            }else{
+                AcceptReassembly(&r, &stats);
+            }
+        }else if(r.has_last){
+            if(!r.parity.empty()) RecoverStripes(&r, &stats);
+            if(r.num_received == r.received.size()) AcceptReassembly(&r, &stats);
+        }
+        return;
+    }
+#ifdef DOUBLE_CHANNEL
+    std::lock_guard<std::mutex> lk(mu_);
+#endif
+    if(my_node_.role == 0 && msg->meta.msg_type == 2){
+        obj->Accept(*msg);
+    }else if(msg->meta.msg_type == 5){   //a DGT block of a pull response
+        if(ReassemblePull(msg)) obj->Accept(*msg);
     }else{  //run on worker side
         obj->Accept(*msg);
     }
 }
 
+bool Van::ReassemblePull(Message* msg) {
+  uint64_t id = (static_cast<uint64_t>(msg->meta.sender) << 32) |
+      static_cast<uint32_t>(msg->meta.first_key);
+  std::lock_guard<std::mutex> lk(pull_copy_mu_);
+  PullCopy& c = pull_copy_[id];
+  size_t total = msg->meta.total_bytes;
+  // a late block of an older pull, the copy may hold newer values
+  if (msg->meta.push_op_num < c.num) return false;
+  const SArray<char>& block = msg->data[1];
+  if (msg->meta.val_bytes + block.size() > total) {
+    LOG(WARNING) << "drop block " << msg->meta.seq << " of key " << msg->meta.first_key
+                 << ", it is out of the pulled range";
+    return false;
+  }
+  if (msg->meta.push_op_num > c.num) {
+    // a worker pulls a key once at a time, the last pull can only be waiting
+    // here if it got no further blocks
+    if (c.has_last) AcceptPull(&c);
+    c.num = msg->meta.push_op_num;
+    c.num_received = 0;
+  }
+  if (c.vals.size() != total) c.vals = SArray<char>(total, 0);
+  size_t num_seq = msg->meta.seq_end + 1;
+  if (c.received.size() != num_seq) c.received.assign(num_seq, 0);
+  if (c.received[msg->meta.seq] == c.num) return false;
+  c.received[msg->meta.seq] = c.num;
+  ++c.num_received;
+  memcpy(c.vals.data() + msg->meta.val_bytes, block.data(), block.size());
+  if (msg->meta.seq == msg->meta.seq_end) {
+    c.last = *msg;
+    c.has_last = true;
+    if (pull_deadline_us_ > 0 && c.num_received < num_seq) {
+      // the seq_end block comes over tcp, ahead of the udp ones
+      c.deadline = std::chrono::steady_clock::now() +
+          std::chrono::microseconds(pull_deadline_us_);
+      pull_pending_.push_back(id);
+      {
+        std::lock_guard<std::mutex> timer_lk(timer_mu_);
+        pending_kick_ = true;
+      }
+      pending_cond_.notify_one();
+      return false;
+    }
+  } else if (!c.has_last || c.num_received < num_seq) {
+    return false;
+  }
+  *msg = FinishPull(&c);
+  return true;
+}
+
+Message Van::FinishPull(PullCopy* c) {
+  Message msg = std::move(c->last);
+  c->last = Message();
+  c->has_last = false;
+  // the app keeps the value, the copy goes on taking blocks
+  size_t total = c->vals.size();
+  SArray<char> vals(total);
+  memcpy(vals.data(), c->vals.data(), total);
+  msg.data[1] = vals;
+  msg.meta.vals_len = total;
+  return msg;
+}
+
+void Van::AcceptPull(PullCopy* c) {
+  Message msg = FinishPull(c);
+  auto* obj = Postoffice::Get()->GetCustomer(msg.meta.app_id, msg.meta.customer_id, 5);
+  CHECK(obj) << "timeout (5 sec) to wait App " << msg.meta.app_id << " customer "
+             << msg.meta.customer_id << " ready";
+  obj->Accept(msg);
+}
+
 void Van::ProcessAddNodeCommand(Message* msg, Meta* nodes,
                                 Meta* recovery_nodes) {
   auto dead_nodes = Postoffice::Get()->GetDeadNodes(heartbeat_timeout_);
@@ -451,6 +899,10 @@ void Van::ProcessAddNodeCommand(Message* msg, Meta* nodes,
       if (!node.is_recovery && node.role == Node::WORKER) ++num_workers_;
     }
     PS_VLOG(1) << my_node_.ShortDebugString() << " is connected to others";
+#ifdef RECONSTRUCT
+    // every node loses its own datagrams, the same ones from run to run
+    faults_.Seed(fault_seed_ + my_node_.id);
+#endif
     ready_ = true;
   }
 }
@@ -500,6 +952,7 @@ void Van::Start(int customer_id) {
 #ifdef DOUBLE_CHANNEL
         if(!is_scheduler_){
          udp_ch_num = atoi(CHECK_NOTNULL(Environment::Get()->find("DMLC_UDP_CHANNEL_NUM")));
+         udp_recv_threads_ = std::max(1, GetEnv("DGT_UDP_RECV_THREADS", 1));
          //std::cout << "udp_ch_num = " << udp_ch_num << std::endl;
           for(int i = 0; i < udp_ch_num; ++i){
               int p = GetAvailablePort();
@@ -509,13 +962,84 @@ void Van::Start(int customer_id) {
 #endif
 #ifdef ENCODE
         enable_encode = atoi(CHECK_NOTNULL(Environment::Get()->find("ENABLE_ENCODE")));
+        encode_bits_ = GetEnv("DGT_ENCODE_BITS", 2);
+        CHECK(encode_bits_ == 1 || encode_bits_ == 2 || encode_bits_ == 4 || encode_bits_ == 8)
+            << "DGT_ENCODE_BITS must be 1, 2, 4 or 8, not " << encode_bits_;
+        encode_stochastic_ = GetEnv("DGT_ENCODE_STOCHASTIC", 0);
 //        std::cout << "enable_encode = " << enable_encode << std::endl;
 #endif
+#ifdef UDP_CHANNEL
+        block_header_ = GetEnv("DGT_BLOCK_HEADER", 1);
+#endif
 #ifdef RECONSTRUCT
         //msg_size_limit = dmlc::GetEnv("DGT_MSG_SIZE_LIMIT", 4 * 1024);
        reconstruct = atoi(CHECK_NOTNULL(Environment::Get()->find("DGT_RECONSTRUCT")));
 //       std::cout << "reconstruct[in van.cc] = " << reconstruct << std::endl;
        ns_delay = atoi(CHECK_NOTNULL(Environment::Get()->find("NS_DELAY")));
+       send_batch_ = std::max(1, GetEnv("DGT_SEND_BATCH", 64));
+       send_priority_ = GetEnv("DGT_SEND_PRIORITY", 0);
+       reassembly_deadline_us_ = GetEnv("DGT_REASSEMBLY_DEADLINE_US", 0);
+       pull_deadline_us_ = GetEnv("DGT_PULL_DEADLINE_US", 0);
+       missing_policy_ = GetEnv("DGT_MISSING_POLICY", 0);
+       error_feedback_ = GetEnv("DGT_ERROR_FEEDBACK", 0);
+       if (shards_.empty()) {
+         int num_shards = std::max(1, GetEnv("DGT_SERVER_THREADS", 1));
+         for (int i = 0; i < num_shards; ++i) shards_.emplace_back(new ReassemblyShard());
+       }
+       const char* decay = Environment::Get()->find("DGT_ARRIVAL_DECAY");
+       if (decay) arrival_decay_ = atof(decay);
+       yield_us_ = GetEnv("DGT_UDP_YIELD_US", 1000);
+       pacer_.Resize(udp_ch_num);
+       // bytes/sec of every udp channel, comma separated. the last one
+       // applies to the remaining channels
+       std::vector<double> rates = GetChannelEnv("DGT_UDP_RATE", udp_ch_num);
+       for (size_t i = 0; i < rates.size(); ++i) pacer_.SetRate(i, rates[i]);
+       // loss in percent and latency of the datagrams received on every
+       // udp channel, separated like DGT_UDP_RATE, to benchmark on loopback
+       std::vector<double> drop = GetChannelEnv("DGT_UDP_DROP", udp_ch_num);
+       std::vector<double> delay = GetChannelEnv("DGT_UDP_DELAY_US", udp_ch_num);
+       std::vector<double> jitter = GetChannelEnv("DGT_UDP_JITTER_US", udp_ch_num);
+       faults_.Resize(udp_ch_num);
+       for (int i = 0; i < udp_ch_num; ++i) {
+         faults_.Set(i, drop.empty() ? 0 : drop[i] / 100,
+                     delay.empty() ? 0 : delay[i], jitter.empty() ? 0 : jitter[i]);
+       }
+       fault_seed_ = GetEnv("DGT_UDP_FAULT_SEED", 0);
+       delay_line_.reset(faults_.delays() ? new DelayLine<Message>() : nullptr);
+       // data:parity blocks per stripe of every udp channel, comma
+       // separated like DGT_UDP_RATE. 0 sends a channel raw
+       const char* fec = Environment::Get()->find("DGT_FEC");
+       if (fec && reconstruct) {
+         std::stringstream ss(fec);
+         std::string item;
+         FECConfig last;
+         bool any = false;
+         fec_.resize(udp_ch_num);
+         for (int i = 0; i < udp_ch_num; ++i) {
+           if (std::getline(ss, item, ',')) {
+             last = FECConfig();
+             sscanf(item.c_str(), "%d:%d", &last.data, &last.parity);
+             if (last.data <= 0 || last.parity <= 0) last = FECConfig();
+             CHECK_LE(last.data + last.parity, ReedSolomon::kMaxBlocks)
+                 << "DGT_FEC stripe too long: " << item;
+           }
+           fec_[i] = last;
+           any |= last.parity > 0;
+         }
+         if (!any) fec_.clear();
+         if (!fec_.empty() && reassembly_deadline_us_ == 0) {
+           LOG(WARNING) << "DGT_FEC without DGT_REASSEMBLY_DEADLINE_US, the "
+                        << "servers accept a push at its last tcp block and "
+                        << "drop the parities of the stripes it closed";
+         }
+       }
+#ifdef ENCODE
+       if (enable_encode && !fec_.empty()) {
+         LOG(WARNING) << "DGT_FEC is ignored with ENABLE_ENCODE, parities "
+                      << "would not match the decoded blocks";
+         fec_.clear();
+       }
+#endif
 #endif
       // cannot determine my id now, the scheduler will assign it later
       // set it explicitly to make re-register within a same process possible
@@ -549,15 +1073,36 @@ void Van::Start(int customer_id) {
             new std::thread(&Van::Receiving, this));
     if(!is_scheduler_){
         // start udp receiver
+        udp_stop_ = false;
         for(int i = 0; i < my_node_.udp_port.size(); ++i){
-            udp_receiver_thread_[i] = std::unique_ptr<std::thread>(
-              new std::thread(&Van::Receiving_UDP,this,i));
-           // udp_receiver_thread_vec.push_back(udp_receiver_thread_);
+            for (int r = 0; r < udp_recv_threads_; ++r) {
+              ++udp_receivers_;
+              udp_receiver_thread_vec.push_back(std::unique_ptr<std::thread>(
+                new std::thread(&Van::Receiving_UDP,this,i)));
+            }
+        }
+#ifdef RECONSTRUCT
+        if (delay_line_) {
+            delay_thread_ = std::unique_ptr<std::thread>(
+                new std::thread(&Van::Delaying_UDP, this));
+        }
+#endif
+        if (!important_queue_) {
+          size_t capacity = GetEnv("DGT_QUEUE_CAPACITY", 1 << 16);
+          important_queue_.reset(new MPSCQueue<Message>(capacity));
+          unimportant_queue_.reset(new MPSCQueue<Message>(capacity));
         }
         important_scheduler_thread_ = std::unique_ptr<std::thread>(
             new std::thread(&Van::Important_scheduler, this));
         unimportant_scheduler_thread_ = std::unique_ptr<std::thread>(
             new std::thread(&Van::Unimportant_scheduler, this));
+#ifdef RECONSTRUCT
+        if((reconstruct && reassembly_deadline_us_ > 0 && Postoffice::Get()->is_server()) ||
+           (pull_deadline_us_ > 0 && Postoffice::Get()->is_worker())){
+            reassembly_thread_ = std::unique_ptr<std::thread>(
+                new std::thread(&Van::Reassembly_timer, this));
+        }
+#endif
     }
 #else
     // start receiver
@@ -633,9 +1178,43 @@ void Van::Stop() {
   CHECK_NE(ret, -1);
 #ifdef DOUBLE_CHANNEL
     tcp_receiver_thread_->join();
-    for(int i = 0; i < udp_receiver_thread_vec.size(); ++i){
-        udp_receiver_thread_[i]->join();
+#ifdef RECONSTRUCT
+    if (reassembly_thread_) {
+      {
+        std::lock_guard<std::mutex> lk(timer_mu_);
+        reassembly_stop_ = true;
+      }
+      pending_cond_.notify_one();
+      reassembly_thread_->join();
+      reassembly_thread_.reset();
+      reassembly_stop_ = false;
+    }
+    BlockStats stats = GetBlockStats();
+    if (stats.on_time.size()) {
+      size_t on_time = 0, late = 0;
+      for (size_t n : stats.on_time) on_time += n;
+      for (size_t n : stats.late) late += n;
+      PS_VLOG(1) << my_node_.ShortDebugString() << " dgt blocks on time " << on_time
+                 << ", late " << late << ", missing " << stats.missing
+                 << ", recovered " << stats.recovered;
+    }
+#endif
+    // udp receivers never see the TERMINATE sent over tcp, wake them up
+    // until they all left. a wake-up datagram may be lost
+    udp_stop_ = true;
+    while (udp_receivers_.load() > 0) {
+      WakeUDPReceivers();
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
+    for (auto& t : udp_receiver_thread_vec) t->join();
+    udp_receiver_thread_vec.clear();
+#ifdef RECONSTRUCT
+    if (delay_thread_) {
+      delay_line_->Stop();
+      delay_thread_->join();
+      delay_thread_.reset();
+    }
+#endif
     if(!is_scheduler_){
         important_scheduler_thread_->join();
         unimportant_scheduler_thread_->join();
@@ -645,11 +1224,15 @@ void Van::Stop() {
 #endif
   init_stage = 0;
   if (!is_scheduler_) heartbeat_thread_->join();
+  PS_VLOG(1) << my_node_.ShortDebugString() << " udp sent " << udp_send_bytes_
+             << " bytes, copied " << udp_copy_bytes_ << " bytes";
   if (resender_) delete resender_;
   ready_ = false;
   connected_nodes_.clear();
   shared_node_mapping_.clear();
   send_bytes_ = 0;
+  udp_send_bytes_ = 0;
+  udp_copy_bytes_ = 0;
   timestamp_ = 0;
   my_node_.id = Meta::kEmpty;
   barrier_count_.clear();
@@ -673,102 +1256,217 @@ void  Van::msg_float_print(Message& msg, int n){
     std::cout << std::endl;
 }
 float Van::encode(Message& msg){
-    SArray<char>& s_val = msg.data[1];
-    float *ps = (float*)s_val.data();
-    int d_val_size = 0;
-    assert(s_val.size() == *((int*)msg.data[2].data()));
-    if(s_val.size()%16 == 0){
-        d_val_size = s_val.size()/16;
-    }else{
-        d_val_size = s_val.size()/16 + 1;
-    }
-    SArray<char> d_val(d_val_size);
-    char *pd = d_val.data();
-    auto it = residual.find(msg.meta.first_key);
-    if(it == residual.end()) residual[msg.meta.first_key] = SArray<char>(s_val.size());
-    float *pr = (float*)residual[msg.meta.first_key].data();
-
-    int param_n = s_val.size() / sizeof(float);
-    float max_v = 0.0, min_v = 0.0;
-    for(int i = 0; i < param_n; ++i){
-        //*(pr+i) += *(ps+i);
-        *(pr+i) = *(ps+i);
-    }
-    for(int i = 0; i < param_n; ++i){
-        max_v = std::max(max_v, *(pr+i));
-        min_v = std::min(min_v, *(pr+i));
-    }
-    for(int i = 0; i < 4; ++i){
-        float zv = ((min_v + i*(max_v-min_v)/4) + (min_v + (i+1)*(max_v-min_v)/4))/2;
-        msg.meta.compr.push_back(zv);
-    }
-    char qj = 0;
-    for(int i = 0; i < param_n; ++i){
-        for(int j=0; j < 4; ++j){
-            if(*(pr+i) >= min_v + j*(max_v-min_v)/4 && *(pr+i) <= min_v + (j+1)*(max_v-min_v)/4){
-                qj = j;
-                break;
-            }
+    // data[2] holds the len of the whole key, the block is only a part of it
+    SArray<char> s_val = msg.data[1];
+    CHECK_LE(msg.meta.val_bytes + s_val.size(), static_cast<size_t>(msg.meta.total_bytes));
+    size_t n = s_val.size() / sizeof(float);
+    // the count goes as a float in compr, exact up to 2^24
+    CHECK_LE(n, 1U << 24) << "block too large to encode";
+    // what the rounding lost on the last pushes of this range goes with this one.
+    // the blocks of a key cover different ranges of its residual
+    // the local copy keeps the buffer alive should another push of the key
+    // with another size replace it meanwhile
+    SArray<char> res;
+    {
+        std::lock_guard<std::mutex> lk(encode_mu_);
+        SArray<char>& buf = residual[msg.meta.first_key];
+        if (buf.size() != static_cast<size_t>(msg.meta.total_bytes)) {
+            buf = SArray<char>(msg.meta.total_bytes, 0);
         }
-        *pd |= (qj << ((3-i%4)*2));
-        if(i%4 == 0) pd += 1;
-        *(pr+i) -= msg.meta.compr[qj];
+        res = buf;
+    }
+    float* r = reinterpret_cast<float*>(res.data() + msg.meta.val_bytes);
+    const float* g = reinterpret_cast<const float*>(s_val.data());
+    for (size_t i = 0; i < n; ++i) r[i] += g[i];
+    QuantizeParam p;
+    p.bits = encode_bits_;
+    float min_v, max_v;
+    MinMax(r, n, &min_v, &max_v);
+    p.min = min_v;
+    p.step = (max_v - min_v) / ((1 << p.bits) - 1);
+    if (encode_stochastic_) {
+        // never 0, that would round to the nearest level
+        p.seed = ((static_cast<uint32_t>(msg.meta.first_key) * 2654435761u) ^
+            (static_cast<uint32_t>(msg.meta.push_op_num) << 16) ^ msg.meta.seq) | 1;
     }
+    SArray<char> d_val(QuantizedBytes(n, p.bits));
+    Quantize(r, n, p, d_val.data());
+    msg.meta.compr = {p.min, p.step, static_cast<float>(p.bits), static_cast<float>(n)};
     msg.data[1] = d_val;
     msg.meta.vals_len = msg.data[1].size();
+    return s_val.size() ? static_cast<float>(d_val.size()) / s_val.size() : 1;
 }
-void Van::decode(Message& msg) {
-    SArray<char>& s_val = msg.data[1];
-    char *ps = (char*)s_val.data();
-    int d_val_size = *((int*)msg.data[2].data());
-    SArray<char> d_val(d_val_size);
-    float *pd = (float*)d_val.data();
-    //int nlen = *((int*)msg.data[2].data());
-    int nlen = s_val.size();
-    char qj = 0;
-    int param_n = d_val_size/sizeof(float);
-    for(int i = 0; i < nlen; ++i){
-        for(int j =0; j<4; ++j){
-            qj = (*(ps+i) >> (6-2*j)) & 0x03;
-            *pd = msg.meta.compr[qj];
-            pd += 1;
-            param_n -= 1;
-            if(param_n == 0) break;
-        }
+bool Van::decode(Message& msg) {
+    if (msg.meta.compr.size() != 4U || msg.data.size() < 2) {
+        LOG(WARNING) << "drop block " << msg.meta.seq << " of key " << msg.meta.first_key
+                     << ", it is not encoded";
+        return false;
+    }
+    QuantizeParam p;
+    p.min = msg.meta.compr[0];
+    p.step = msg.meta.compr[1];
+    p.bits = static_cast<int>(msg.meta.compr[2]);
+    size_t n = static_cast<size_t>(msg.meta.compr[3]);
+    if ((p.bits != 1 && p.bits != 2 && p.bits != 4 && p.bits != 8) ||
+        msg.data[1].size() != QuantizedBytes(n, p.bits)) {
+        LOG(WARNING) << "drop block " << msg.meta.seq << " of key " << msg.meta.first_key
+                     << ", its encoded size does not match";
+        return false;
     }
+    SArray<char> d_val(n * sizeof(float));
+    Dequantize(msg.data[1].data(), n, p, reinterpret_cast<float*>(d_val.data()));
     msg.data[1] = d_val;
     msg.meta.vals_len = msg.data[1].size();
+    return true;
 }
 #endif
-int Van::Classifier( Message& msg, int channel, int tag) {
+int Van::Classifier( Message&& msg, int channel, int tag) {
+#ifdef ENCODE
+    // the receivers decode every push block, whatever channel it came on
+    if(enable_encode && msg.meta.msg_type == 2) encode(msg);
+#endif
     if(channel == 0){
-        important_queue_.Push(msg);
+        if(!fec_.empty() && msg.meta.msg_type == 2 && msg.meta.seq == msg.meta.seq_end){
+            // the push ends here, close the stripes it left open
+            std::vector<Stripe>* stripes = GetStripes(msg);
+            for(size_t c = 0; c < stripes->size(); ++c){
+                if(!(*stripes)[c].seqs.empty()) EmitParity(msg, c+1, &(*stripes)[c]);
+            }
+        }
+        important_queue_->Push(std::move(msg));
     }else{
-        unimportant_queue_.Push(msg);
+        if(channel <= (int)fec_.size() && fec_[channel-1].parity > 0 && msg.meta.msg_type == 2){
+            AddToStripe(msg, channel);
+        }
+        unimportant_queue_->Push(std::move(msg));
     }
 return 1;
 }
+std::vector<Van::Stripe>* Van::GetStripes(const Message& msg) {
+    uint64_t id = (static_cast<uint64_t>(msg.meta.recver) << 32) |
+        static_cast<uint32_t>(msg.meta.first_key);
+    // a key is pushed by one thread at a time, only the map needs the lock
+    std::lock_guard<std::mutex> lk(fec_mu_);
+    std::vector<Stripe>& stripes = stripes_[id];
+    if(stripes.size() != fec_.size()) stripes.resize(fec_.size());
+    return &stripes;
+}
+void Van::AddToStripe(const Message& msg, int channel) {
+    if(msg.data.size() < 2) return;
+    const FECConfig& cfg = fec_[channel-1];
+    Stripe* s = &(*GetStripes(msg))[channel-1];
+    const SArray<char>& val = msg.data[1];
+    // the members of a stripe are as long as its parities
+    if(!s->seqs.empty() && val.size() != s->len) EmitParity(msg, channel, s);
+    if(s->seqs.empty()){
+        s->len = val.size();
+        s->parity.resize(cfg.parity);
+        for(auto& p : s->parity) p = SArray<char>(s->len, 0);
+    }
+    int pos = s->seqs.size();
+    for(int j = 0; j < cfg.parity; ++j){
+        ReedSolomon::MulAdd(ReedSolomon::Coef(j, pos), val.data(), s->len, s->parity[j].data());
+    }
+    s->seqs.push_back(msg.meta.seq);
+    if((int)s->seqs.size() == cfg.data) EmitParity(msg, channel, s);
+}
+void Van::EmitParity(const Message& block, int channel, Stripe* s) {
+    for(size_t j = 0; j < s->parity.size(); ++j){
+        Message msg;
+        msg.meta = block.meta;
+        msg.meta.msg_type = 4;
+        msg.meta.channel = channel;
+        msg.meta.seq = j;
+        msg.meta.val_bytes = s->len;
+        msg.meta.channel_sent.clear();
+        msg.meta.fec_seq = s->seqs;
+        msg.data = block.data;
+        msg.data[1] = s->parity[j];
+        msg.meta.vals_len = msg.data[1].size();
+        msg.meta.data_size = 0;
+        for(const auto& d : msg.data) msg.meta.data_size += d.size();
+        unimportant_queue_->Push(std::move(msg));
+    }
+    s->seqs.clear();
+    s->parity.clear();
+}
 void Van::Important_scheduler() {
+  std::vector<Message> batch;
+  batch.reserve(send_batch_);
+  SendHeap heap;
   while (true) {
-    Message msg;
-    important_queue_.WaitAndPop(&msg);
-    Important_send(msg);
+    if (send_priority_) {
+      // one at a time, a block queued meanwhile may pass the others
+      PopByPriority(important_queue_.get(), &heap, &batch, 1);
+    } else {
+      important_queue_->WaitAndPopBatch(&batch, send_batch_);
+    }
+    for (auto& msg : batch) Important_send(msg);
+    if (heap.empty() && important_queue_->empty()) {
+      std::lock_guard<std::mutex> lk(yield_mu_);
+      yield_cond_.notify_all();
+    }
   }
 }
+void Van::PopByPriority(MPSCQueue<Message>* queue, SendHeap* heap,
+                        std::vector<Message>* batch, size_t max_num) {
+  batch->clear();
+  if (heap->empty()) queue->WaitAndPopBatch(batch, send_batch_);
+  do {
+    for (auto& msg : *batch) heap->Push(std::move(msg));
+    batch->clear();
+  } while (queue->TryPopBatch(batch, send_batch_));
+  heap->PopBatch(batch, max_num);
+}
 void Van::Unimportant_scheduler() {
     struct timespec req;
     req.tv_sec = 0;
     req.tv_nsec = ns_delay;
+    std::vector<Message> batch, run;
+    batch.reserve(send_batch_);
+    run.reserve(send_batch_);
+    SendHeap heap;
   while (true) {
     //if(important_queue_.empty()){
-        Message msg;
-        unimportant_queue_.WaitAndPop(&msg);
-        Unimportant_send(msg);
-        nanosleep(&req,NULL);//
+        if (send_priority_) {
+            PopByPriority(unimportant_queue_.get(), &heap, &batch, send_batch_);
+        } else {
+            unimportant_queue_->WaitAndPopBatch(&batch, send_batch_);
+        }
+        YieldToImportant();
+        if (!pacer_.enabled() && ns_delay > 0) {
+            for (auto& msg : batch) {
+                Unimportant_send(msg);
+                nanosleep(&req,NULL);//
+            }
+            continue;
+        }
+        // send the blocks the buckets can afford in one go, then wait for
+        // the tokens of the next one
+        run.clear();
+        for (auto& msg : batch) {
+            int channel = msg.meta.channel - 1;
+            size_t bytes = 0;
+            for (const auto& d : msg.data) bytes += d.size();
+            if (!pacer_.TryAcquire(channel, bytes)) {
+                if (run.size()) CHECK_NE(SendMsgBatch_UDP(&run), -1);
+                run.clear();
+                YieldToImportant();
+                pacer_.Acquire(channel, bytes);
+            }
+            run.push_back(std::move(msg));
+        }
+        if (run.size()) CHECK_NE(SendMsgBatch_UDP(&run), -1);
     //}//
 
   }
 }
+void Van::YieldToImportant() {
+  if (important_queue_->empty()) return;
+  std::unique_lock<std::mutex> lk(yield_mu_);
+  yield_cond_.wait_for(lk, std::chrono::microseconds(yield_us_),
+                       [this] { return important_queue_->empty(); });
+}
 int Van::Important_send(Message& msg) {
   int send_bytes = SendMsg(msg);
   CHECK_NE(send_bytes, -1);
@@ -790,8 +1488,19 @@ int Van::Unimportant_send(Message& msg) {
   return send_bytes;
 }
 
+int Van::SendMsgBatch_UDP(std::vector<Message>* msgs) {
+  int send_bytes = 0;
+  for (auto& msg : *msgs) send_bytes += Unimportant_send(msg);
+  return send_bytes;
+}
+
 int Van::Send( Message& msg, int channel, int tag) {
 	int send_bytes = 0;
+#ifdef RECONSTRUCT
+    if(reconstruct && my_node_.role == 0 && msg.meta.push && !msg.meta.request){
+        StampFeedback(&msg);
+    }
+#endif
 #ifdef ENCODE
     if(enable_encode && msg.meta.msg_type == 2){  //if msg is push's gradient,then encode the msg
         //std::cout << "***" << msg.DebugString() << std::endl;
@@ -880,7 +1589,7 @@ int Van::Send(const Message& msg) {
 #ifdef ENCODE
             if(enable_encode && msg.meta.msg_type == 2){   //if msg is push's gradient,then decode it
       // std::cout << "$$$" << msg.DebugString() << std::endl;
-       decode(msg);
+       if(!decode(msg)) continue;
        //std::cout << "@@@" << msg.DebugString() << std::endl;
        //msg_float_print(msg, 20);
     }
@@ -935,6 +1644,8 @@ int Van::Send(const Message& msg) {
         while (true) {
             Message msg;
             int recv_bytes = RecvMsg_UDP(channel, &msg);
+            if (udp_stop_.load()) break;
+            if (recv_bytes == -1 && !ready_.load()) break;  // stopped
 
             // For debug, drop received message
             if (ready_.load() && drop_rate_ > 0) {
@@ -944,13 +1655,18 @@ int Van::Send(const Message& msg) {
                     continue;
                 }
             }
-#ifdef ENCODE
-            if(enable_encode && msg.meta.msg_type == 2){   //if msg is push's gradient,then decode it
-       //std::cout << "$$$" << msg.DebugString() << std::endl;
-       decode(msg);
-       //std::cout << "@@@" << msg.DebugString() << std::endl;
-       //msg_float_print(msg, 20);
-    }
+#ifdef RECONSTRUCT
+            // the injected faults only hit data, the control messages
+            // and the acked ones going through as they are
+            FaultInjector::Clock::time_point due;
+            bool faulty = ready_.load() && recv_bytes != -1 &&
+                msg.meta.control.empty() && !msg.meta.udp_reliable;
+            if (faulty && faults_.Draw(channel, msg.meta.sender, &due)) continue;
+            if (faulty && delay_line_) {
+                recv_bytes_ += recv_bytes;
+                delay_line_->Push(due, std::move(msg));
+                continue;
+            }
 #endif
             CHECK_NE(recv_bytes, -1);
             recv_bytes_ += recv_bytes;
@@ -978,14 +1694,31 @@ int Van::Send(const Message& msg) {
                 }
             } else {
 //		    std::cout<<"node-1 receving_udp"<<std::endl;
-                ProcessDataMsg(&msg);
+                ProcessUDPData(&msg);
                 if(msg.meta.sender == 9)
                     udp_recv++;
 
             }
         }
+        --udp_receivers_;
+    }
+
+    void Van::ProcessUDPData(Message* msg) {
+#ifdef ENCODE
+        if(enable_encode && msg->meta.msg_type == 2){   //if msg is push's gradient,then decode it
+            if(!decode(*msg)) return;
+        }
+#endif
+        ProcessDataMsg(msg);
     }
 
+#ifdef RECONSTRUCT
+    void Van::Delaying_UDP() {
+        Message msg;
+        while (delay_line_->Pop(&msg)) ProcessUDPData(&msg);
+    }
+#endif
+
 void Van::Receiving() {
   Meta nodes;
   Meta recovery_nodes;  // store recovery nodes
@@ -1057,6 +1790,10 @@ void Van::PackMetaPB(const Meta& meta, PBMeta* pb) {
     pb->set_udp_reliable(meta.udp_reliable);
     pb->set_channel(meta.channel);
     for (auto v : meta.compr) pb->add_compr(v);
+    for (auto v : meta.channel_sent) pb->add_channel_sent(v);
+    for (auto v : meta.channel_arrival) pb->add_channel_arrival(v);
+    for (auto v : meta.missing_seq) pb->add_missing_seq(v);
+    for (auto v : meta.fec_seq) pb->add_fec_seq(v);
     pb->set_msg_type(meta.msg_type);
     pb->set_push_op(meta.push_op_num);
     pb->set_val_bytes(meta.val_bytes);
@@ -1095,7 +1832,148 @@ void Van::PackMetaPB(const Meta& meta, PBMeta* pb) {
   pb->set_data_size(meta.data_size);
 }
 
+#ifdef UDP_CHANNEL
+bool Van::PackBlockMeta(const Meta& meta, char** meta_buf, int* buf_size) {
+  // the fields a DGT block needs, anything else goes as protobuf
+  if (meta.msg_type != 2 || !meta.control.empty() || meta.simple_app ||
+      meta.body.size() || meta.channel_arrival.size() || meta.missing_seq.size() ||
+      meta.fec_seq.size() || meta.data_type.size() > 255 || meta.compr.size() > 255 ||
+      meta.channel_sent.size() > 255 || meta.channel < 0 || meta.channel > 0xffff) {
+    return false;
+  }
+  BlockHeader h;
+  memset(&h, 0, sizeof(h));
+  h.magic = kBlockMagic;
+  h.version = kBlockVersion;
+  h.flags = (meta.request ? kBlockRequest : 0) | (meta.push ? kBlockPush : 0) |
+      (meta.pull ? kBlockPull : 0) | (meta.udp_reliable ? kBlockUDPReliable : 0);
+  h.num_data_type = meta.data_type.size();
+  h.num_compr = meta.compr.size();
+  h.num_channel_sent = meta.channel_sent.size();
+  h.channel = meta.channel;
+  h.head = meta.head;
+  h.app_id = meta.app_id;
+  h.customer_id = meta.customer_id;
+  h.timestamp = meta.timestamp;
+  h.tracker_num = meta.tracker_num;
+  h.sender = my_node_.id;
+  h.recver = meta.recver;
+  h.first_key = meta.first_key;
+  h.seq = meta.seq;
+  h.seq_begin = meta.seq_begin;
+  h.seq_end = meta.seq_end;
+  h.val_bytes = meta.val_bytes;
+  h.total_bytes = meta.total_bytes;
+  h.push_op_num = meta.push_op_num;
+  h.keys_len = meta.keys_len;
+  h.vals_len = meta.vals_len;
+  h.lens_len = meta.lens_len;
+  h.priority = meta.priority;
+  *buf_size = sizeof(h) + h.num_data_type + h.num_compr * sizeof(float) +
+      h.num_channel_sent * sizeof(int32_t);
+  *meta_buf = new char[*buf_size + 1];
+  char* p = *meta_buf;
+  memcpy(p, &h, sizeof(h));
+  p += sizeof(h);
+  for (auto d : meta.data_type) *p++ = static_cast<char>(d);
+  memcpy(p, meta.compr.data(), h.num_compr * sizeof(float));
+  p += h.num_compr * sizeof(float);
+  for (int v : meta.channel_sent) {
+    int32_t x = v;
+    memcpy(p, &x, sizeof(x));
+    p += sizeof(x);
+  }
+  return true;
+}
+
+bool Van::UnpackBlockMeta(const char* meta_buf, int buf_size, Meta* meta) {
+  BlockHeader h;
+  if (static_cast<size_t>(buf_size) < sizeof(h)) {
+    LOG(WARNING) << "truncated block header of " << buf_size << " bytes";
+    return false;
+  }
+  memcpy(&h, meta_buf, sizeof(h));
+  if (h.version != kBlockVersion) {
+    LOG(WARNING) << "block header version " << static_cast<int>(h.version)
+                 << ", this node reads " << static_cast<int>(kBlockVersion);
+    return false;
+  }
+  if (static_cast<size_t>(buf_size) != sizeof(h) + h.num_data_type +
+      h.num_compr * sizeof(float) + h.num_channel_sent * sizeof(int32_t)) {
+    LOG(WARNING) << "block header of a wrong size, " << buf_size << " bytes";
+    return false;
+  }
+  meta->head = h.head;
+  meta->app_id = h.app_id;
+  meta->customer_id = h.customer_id;
+  meta->timestamp = h.timestamp;
+  meta->tracker_num = h.tracker_num;
+  meta->sender = h.sender;
+  meta->recver = h.recver;
+  meta->first_key = h.first_key;
+  meta->seq = h.seq;
+  meta->seq_begin = h.seq_begin;
+  meta->seq_end = h.seq_end;
+  meta->val_bytes = h.val_bytes;
+  meta->total_bytes = h.total_bytes;
+  meta->push_op_num = h.push_op_num;
+  meta->keys_len = h.keys_len;
+  meta->vals_len = h.vals_len;
+  meta->lens_len = h.lens_len;
+  meta->priority = h.priority;
+  meta->channel = h.channel;
+  meta->msg_type = 2;
+  meta->request = h.flags & kBlockRequest;
+  meta->push = h.flags & kBlockPush;
+  meta->pull = h.flags & kBlockPull;
+  meta->udp_reliable = h.flags & kBlockUDPReliable;
+  meta->simple_app = false;
+  meta->control.cmd = Control::EMPTY;
+  const char* p = meta_buf + sizeof(h);
+  meta->data_type.resize(h.num_data_type);
+  for (auto& d : meta->data_type) d = static_cast<DataType>(*p++);
+  meta->compr.resize(h.num_compr);
+  memcpy(meta->compr.data(), p, h.num_compr * sizeof(float));
+  p += h.num_compr * sizeof(float);
+  meta->channel_sent.resize(h.num_channel_sent);
+  for (auto& v : meta->channel_sent) {
+    int32_t x;
+    memcpy(&x, p, sizeof(x));
+    p += sizeof(x);
+    v = x;
+  }
+  return true;
+}
+#endif
+
+int Van::BlockOverhead(int msg_type, int num_channels) {
+  // -1 takes the longest varint, 10 bytes
+  Meta meta;
+  meta.head = meta.app_id = meta.customer_id = meta.timestamp = -1;
+  meta.tracker_num = meta.recver = meta.priority = -1;
+  meta.request = meta.push = meta.pull = true;
+  meta.data_type = {UINT64, CHAR, INT32};
+#ifdef UDP_CHANNEL
+  meta.msg_type = msg_type;
+  meta.udp_reliable = true;
+  meta.channel = num_channels;
+  meta.first_key = meta.seq = meta.seq_begin = meta.seq_end = -1;
+  meta.val_bytes = meta.total_bytes = meta.push_op_num = -1;
+  meta.keys_len = meta.vals_len = meta.lens_len = -1;
+  meta.compr.assign(4, 0);
+  meta.channel_sent.assign(num_channels, -1);
+#endif
+  char* buf = nullptr;
+  int size = 0;
+  PackMeta(meta, &buf, &size);
+  delete[] buf;
+  return sizeof(int) + size + sizeof(Key) + sizeof(int);
+}
+
 void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
+#ifdef UDP_CHANNEL
+  if (block_header_ && PackBlockMeta(meta, meta_buf, buf_size)) return;
+#endif
   // convert into protobuf
   PBMeta pb;
   pb.set_head(meta.head);
@@ -1119,6 +1997,10 @@ void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
     pb.set_udp_reliable(meta.udp_reliable);
     pb.set_channel(meta.channel);
     for (auto v : meta.compr) pb.add_compr(v);
+    for (auto v : meta.channel_sent) pb.add_channel_sent(v);
+    for (auto v : meta.channel_arrival) pb.add_channel_arrival(v);
+    for (auto v : meta.missing_seq) pb.add_missing_seq(v);
+    for (auto v : meta.fec_seq) pb.add_fec_seq(v);
     pb.set_msg_type(meta.msg_type);
     pb.set_push_op(meta.push_op_num);
     pb.set_val_bytes(meta.val_bytes);
@@ -1164,10 +2046,21 @@ void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
 }
 
 void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
+  CHECK(TryUnpackMeta(meta_buf, buf_size, meta)) << "failed to unpack the meta";
+}
+
+bool Van::TryUnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
+#ifdef UDP_CHANNEL
+  if (buf_size > 0 && static_cast<uint8_t>(meta_buf[0]) == kBlockMagic) {
+    return UnpackBlockMeta(meta_buf, buf_size, meta);
+  }
+#endif
   // to protobuf
   PBMeta pb;
-  CHECK(pb.ParseFromArray(meta_buf, buf_size))
-      << "failed to parse string into protobuf";
+  if (!pb.ParseFromArray(meta_buf, buf_size)) {
+    LOG(WARNING) << "failed to parse string into protobuf";
+    return false;
+  }
 
   // to meta
   meta->head = pb.head();
@@ -1190,6 +2083,10 @@ void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
     for(int i = 0; i < pb.compr_size();++i){
         meta->compr.push_back(pb.compr(i));
     }
+    meta->channel_sent.assign(pb.channel_sent().begin(), pb.channel_sent().end());
+    meta->channel_arrival.assign(pb.channel_arrival().begin(), pb.channel_arrival().end());
+    meta->missing_seq.assign(pb.missing_seq().begin(), pb.missing_seq().end());
+    meta->fec_seq.assign(pb.fec_seq().begin(), pb.fec_seq().end());
     meta->msg_type = pb.msg_type();
     meta->push_op_num = pb.push_op();
     meta->val_bytes = pb.val_bytes();
@@ -1230,6 +2127,7 @@ void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
   } else {
     meta->control.cmd = Control::EMPTY;
   }
+  return true;
 }
 
 void Van::Heartbeat() {
@@ -12,6 +12,11 @@
 #include <assert.h>
 #if _MSC_VER
 #define rand_r(x) rand()
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #ifndef CHANNEL_LOG
@@ -19,6 +24,8 @@
 #endif
 
 namespace ps {
+/** \brief the group every DGT RADIO/DISH pair joins */
+static const char kGroup[] = "GRADIENT";
 /**
  * \brief be smart on freeing recved data
  */
@@ -59,6 +66,10 @@ class ZMQVan : public Van {
     }
     start_mu_.unlock();
     // zmq_ctx_set(context_, ZMQ_IO_THREADS, 4);
+#ifndef _MSC_VER
+    // DMLC_LOCAL runs the udp channels over ipc, which only zmq speaks
+    udp_zero_copy_ = GetEnv("DGT_UDP_ZERO_COPY", 1) && !GetEnv("DMLC_LOCAL", 0);
+#endif
     Van::Start(customer_id);
     enable_send_drop = atoi(CHECK_NOTNULL(Environment::Get()->find("DGT_ENABLE_SEND_DROP")));
     
@@ -78,6 +89,12 @@ class ZMQVan : public Van {
       CHECK_EQ(zmq_close(it.second), 0);
     }
     senders_.clear();
+#ifndef _MSC_VER
+    for (auto& it : udp_fds_) {
+      for (int fd : it.second) if (fd >= 0) close(fd);
+    }
+    udp_fds_.clear();
+#endif
     zmq_ctx_destroy(context_);
     context_ = nullptr;
   }
@@ -118,7 +135,7 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
             udp_port = 10000 + rand_r(&seed) % 40000;
           }
         }
-        rc = zmq_join(udp_receiver_, "GRADIENT");
+        rc = zmq_join(udp_receiver_, kGroup);
         assert(rc == 0);
        // if(i==node.udp_port.size()-1)
        // {std::cout << "Bind Udp channel["<< i+1 <<"] SUCCESS!!"<< std::endl;}
@@ -129,6 +146,37 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
 
   }
 
+  void WakeUDPReceivers() override {
+    // an empty message to every DISH socket, once per thread receiving on it
+    Meta meta;
+    int meta_size; char* meta_buf;
+    PackMeta(meta, &meta_buf, &meta_size);
+    std::string body(sizeof(meta_size) + meta_size, 0);
+    memcpy(&body[0], &meta_size, sizeof(meta_size));
+    memcpy(&body[sizeof(meta_size)], meta_buf, meta_size);
+    delete[] meta_buf;
+    int local = GetEnv("DMLC_LOCAL", 0);
+    for (int port : my_node_.udp_port) {
+      void* s = zmq_socket(context_, ZMQ_RADIO);
+      if (s == nullptr) continue;
+      std::string addr = local ? "ipc:///tmp/" + std::to_string(port) :
+          "udp://" + my_node_.hostname + ":" + std::to_string(port);
+      if (zmq_connect(s, addr.c_str()) == 0) {
+        for (int r = 0; r < udp_recv_threads_; ++r) {
+          zmq_msg_t msg;
+          zmq_msg_init_size(&msg, body.size());
+          memcpy(zmq_msg_data(&msg), body.data(), body.size());
+          zmq_msg_set_group(&msg, kGroup);
+          if (zmq_msg_send(&msg, s, ZMQ_DONTWAIT) == -1) zmq_msg_close(&msg);
+        }
+      }
+      // long enough for the datagrams to leave before the context goes
+      int linger = 1000;
+      zmq_setsockopt(s, ZMQ_LINGER, &linger, sizeof(linger));
+      zmq_close(s);
+    }
+  }
+
   void Connect_UDP(const Node& node) override {
 
     CHECK_NE(node.id, node.kEmpty);
@@ -142,6 +190,13 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
       }
 
     }
+#ifndef _MSC_VER
+    auto fit = udp_fds_.find(id);
+    if (fit != udp_fds_.end()) {
+      for (int fd : fit->second) if (fd >= 0) close(fd);
+      udp_fds_.erase(fit);
+    }
+#endif
     // worker doesn't need to connect to the other workers. same for server
     if ((node.role == my_node_.role) && (node.id != my_node_.id)) {
       return;
@@ -192,6 +247,12 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
         }
         //udp_senders_[id] = udp_sender;
         udp_senders_[id].push_back(udp_sender);
+#ifndef _MSC_VER
+        if (udp_zero_copy_) {
+          int tos = (node.udp_port.size()-i-1)*32;
+          udp_fds_[id].push_back(ConnectDatagram(node.hostname, node.udp_port[i], tos));
+        }
+#endif
         //write server info to log
     #ifdef CHANNEL_LOG
         if(node.role == 0){
@@ -326,6 +387,7 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
     //std::cout << "#172:SendMsg" << std::endl;
     addr_offset += sizeof(meta_size);
     memcpy(send_buf+addr_offset, meta_buf, meta_size);
+    delete[] meta_buf;
     //std::cout << "#175:SendMsg" << std::endl;
     addr_offset += meta_size;
     for(int i = 0; i < n; ++i){
@@ -361,6 +423,14 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
         return -1;
     }
     void *socket = it->second[channel];
+#ifndef _MSC_VER
+    if (udp_zero_copy_) {
+      auto fit = udp_fds_.find(id);
+      if (fit != udp_fds_.end() && fit->second[channel] >= 0) {
+        return SendDatagram(fit->second[channel], msg);
+      }
+    }
+#endif
     //std::cout << "#160:SendMsg:" << std::endl;
     int meta_size; char* meta_buf;
     int n = msg.data.size();
@@ -380,6 +450,7 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
     memcpy(send_buf, (char*)&meta_size, sizeof(meta_size));
     addr_offset += sizeof(meta_size);
     memcpy(send_buf+addr_offset, meta_buf, meta_size);
+    delete[] meta_buf;
     addr_offset += meta_size;
     for(int i = 0; i < n; ++i){
         //SArray<char>* data = new SArray<char>(msg.data[i]);
@@ -389,13 +460,15 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
         //delete data;
     }
     assert(tot_bytes == addr_offset);
+    udp_copy_bytes_ += tot_bytes;
+    udp_send_bytes_ += tot_bytes;
     if(enable_send_drop){
         free(send_buf);
         return tot_bytes;
     }//
     zmq_msg_t data_msg;
     zmq_msg_init_data(&data_msg, send_buf, tot_bytes, FreeData_malloc, NULL);
-    zmq_msg_set_group (&data_msg, "GRADIENT");
+    zmq_msg_set_group (&data_msg, kGroup);
 
     while (true) {//
         if (zmq_msg_send(&data_msg, socket, tag) == tot_bytes) break;
@@ -409,6 +482,92 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
     return send_bytes;
   }
 
+  /** \brief whether udp blocks are dropped before sending, DGT_ENABLE_SEND_DROP */
+  bool send_drop() const { return enable_send_drop; }
+
+#ifndef _MSC_VER
+  /**
+   * \brief open a plain udp socket connected to a peer's DISH port
+   * \return the socket, or -1 to send that channel through the zmq RADIO
+   * socket, copied, instead
+   */
+  int ConnectDatagram(const std::string& hostname, int port, int tos) {
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    int rc = getaddrinfo(hostname.c_str(), std::to_string(port).c_str(), &hints, &res);
+    if (rc != 0) {
+      LOG(WARNING) << "udp: failed to resolve " << hostname << ": " << gai_strerror(rc)
+                   << ", copying its datagrams";
+      return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0) {
+      setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+      int udp_send_buf_size = 16*1024*1024;
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &udp_send_buf_size, sizeof(udp_send_buf_size));
+      if (connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    if (fd < 0) {
+      LOG(WARNING) << "udp: socket to " << hostname << ":" << port << " failed: "
+                   << strerror(errno) << ", copying its datagrams";
+    }
+    freeaddrinfo(res);
+    return fd;
+  }
+
+  /**
+   * \brief gather the packed meta and msg.data straight from the SArrays
+   * into one datagram with sendmsg, without staging them in a send buffer.
+   *
+   * the datagram carries the same framing as a zmq RADIO frame (one byte of
+   * group length, the group, then the body), so the DISH receivers accept it
+   * unchanged.
+   */
+  int SendDatagram(int fd, const Message& msg) {
+    int meta_size; char* meta_buf;
+    PackMeta(msg.meta, &meta_buf, &meta_size);
+    unsigned char group_size = sizeof(kGroup) - 1;
+    std::vector<struct iovec> iov(4 + msg.data.size());
+    iov[0].iov_base = &group_size;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = const_cast<char*>(kGroup);
+    iov[1].iov_len = group_size;
+    iov[2].iov_base = &meta_size;
+    iov[2].iov_len = sizeof(meta_size);
+    iov[3].iov_base = meta_buf;
+    iov[3].iov_len = meta_size;
+    size_t tot_bytes = sizeof(meta_size) + meta_size;
+    for (size_t i = 0; i < msg.data.size(); ++i) {
+      iov[4+i].iov_base = msg.data[i].data();
+      iov[4+i].iov_len = msg.data[i].size();
+      tot_bytes += msg.data[i].size();
+    }
+    if (enable_send_drop) {
+      delete[] meta_buf;
+      return tot_bytes;
+    }
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov.data();
+    mh.msg_iovlen = iov.size();
+    ssize_t rc;
+    while ((rc = sendmsg(fd, &mh, 0)) < 0 && errno == EINTR) { }
+    delete[] meta_buf;
+    if (rc < 0) {
+      LOG(WARNING) << "udp:failed to send message to node [" << msg.meta.recver
+                   << "] errno: " << errno << " " << strerror(errno);
+      return -1;
+    }
+    udp_send_bytes_ += tot_bytes;
+    return tot_bytes;
+  }
+#endif
+
   int SendMsg(const Message& msg) override {
     std::lock_guard<std::mutex> lk(mu_);
     // find the socket
@@ -477,15 +636,34 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
         size_t size = zmq_msg_size(zmsg);
         recv_bytes += size;
 
-        int  meta_size;
+        int  meta_size = 0;
         int addr_offset = 0;
-        memcpy((void*)&meta_size, buf+addr_offset, sizeof(meta_size));
+        if (size >= sizeof(meta_size)) memcpy((void*)&meta_size, buf+addr_offset, sizeof(meta_size));
         addr_offset += sizeof(meta_size);
 
         // task
-        UnpackMeta(buf+addr_offset, meta_size, &(msg->meta));
+        if (size < sizeof(meta_size) || meta_size < 0 || sizeof(meta_size) + meta_size > size ||
+            !TryUnpackMeta(buf+addr_offset, meta_size, &(msg->meta))) {
+            LOG(WARNING) << "udp: drop a datagram with a bad meta on channel " << channel + 1;
+            zmq_msg_close(zmsg);
+            delete zmsg;
+            msg->meta = Meta();
+            recv_bytes = 0;
+            continue;
+        }
         addr_offset += meta_size;
 
+        int lens[] = {msg->meta.keys_len, msg->meta.vals_len, msg->meta.lens_len};
+        if (msg->meta.keys_len > 0 &&
+            !DataFits(lens, msg->meta.lens_len > 0 ? 3 : 2, addr_offset, size)) {
+            LOG(WARNING) << "udp: drop a datagram of " << size << " bytes shorter than "
+                         << "its meta on channel " << channel + 1;
+            zmq_msg_close(zmsg);
+            delete zmsg;
+            msg->meta = Meta();
+            recv_bytes = 0;
+            continue;
+        }
         if(msg->meta.keys_len > 0){
             SArray<char> data;
 
@@ -692,6 +870,12 @@ std::vector<int> Bind_UDP(const Node& node, int max_retry) override {
   bool identify_flag = false; //if or not read the identify already
   int enable_send_drop = 0;
   std::unordered_map<int,std::unordered_map<int,int>> channel_manage_sheet;
+  /** \brief send udp channels with sendmsg instead of zmq RADIO, DGT_UDP_ZERO_COPY */
+  int udp_zero_copy_ = 0;
+#ifndef _MSC_VER
+  /** \brief node_id to the plain udp sockets of its channels */
+  std::unordered_map<int, std::vector<int>> udp_fds_;
+#endif
 #endif
 #ifdef CHANNEL_LOG
   FILE *fp;
@@ -0,0 +1,313 @@
+/**
+ * \brief end to end benchmark of the DGT pushes on loopback
+ *
+ * Started without DMLC_ROLE, launches itself as the scheduler, the servers
+ * (DMLC_NUM_SERVER, 1 by default) and the workers (DMLC_NUM_WORKER, 2 by
+ * default) on 127.0.0.1, as separate processes since the postoffice is one
+ * per process. The DGT settings come from the environment, the ones a node
+ * cannot start without defaulting to two udp channels with reassembly.
+ * DGT_UDP_DROP, DGT_UDP_DELAY_US and DGT_UDP_JITTER_US inject loss and
+ * latency per channel, the same losses on every run with
+ * DMLC_PS_VAN_TYPE=sim.
+ *
+ * Every iteration, a worker pushes the synthetic gradient of every layer of
+ * the model, one key per layer like the kvstore does, from the last layer to
+ * the first as the backward pass produces them, and waits for them. Like the
+ * kvstore, a layer is pushed with priority minus its index, so with
+ * DGT_SEND_PRIORITY=1 the van sends the first layers, the ones the next
+ * forward pass needs first, ahead of the blocks still queued.
+ * Workers report the push latency per iteration, how long the first layer
+ * took, and the cpu time spent in the push calls, servers the goodput of
+ * every channel, how complete the reassembled pushes were and the cpu time
+ * spent in the request handle.
+ *
+ * usage: test_dgt_bench [model] [iterations] [scale]
+ *
+ * model is resnet50, bert-base or uniform:<layers>x<floats>, the size of
+ * every layer being divided by scale
+ */
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+// kv_app.h reads its DGT settings with dmlc::GetEnv, the kvstore including
+// it before ps-lite
+#include "dmlc/parameter.h"
+#include "ps/ps.h"
+using namespace ps;
+
+typedef std::chrono::steady_clock Clock;
+
+double Seconds(Clock::time_point start, Clock::time_point end) {
+  return std::chrono::duration<double>(end - start).count();
+}
+
+/** \brief user and system cpu seconds of this process */
+void CpuTime(double* user, double* sys) {
+  rusage r;
+  getrusage(RUSAGE_SELF, &r);
+  *user = r.ru_utime.tv_sec + r.ru_utime.tv_usec / 1e6;
+  *sys = r.ru_stime.tv_sec + r.ru_stime.tv_usec / 1e6;
+}
+
+/** \brief the floats of every parameter of resnet-50, batch norm included */
+std::vector<int> ResNet50() {
+  std::vector<int> layers;
+  auto conv = [&](int in, int out, int k) { layers.push_back(in * out * k * k); };
+  auto bn = [&](int c) { layers.push_back(c); layers.push_back(c); };
+  conv(3, 64, 7); bn(64);
+  int in = 64;
+  const int blocks[] = {3, 4, 6, 3};
+  for (int s = 0; s < 4; ++s) {
+    int w = 64 << s;
+    for (int b = 0; b < blocks[s]; ++b) {
+      conv(in, w, 1); bn(w);
+      conv(w, w, 3); bn(w);
+      conv(w, 4 * w, 1); bn(4 * w);
+      if (b == 0) { conv(in, 4 * w, 1); bn(4 * w); }
+      in = 4 * w;
+    }
+  }
+  layers.push_back(2048 * 1000);
+  layers.push_back(1000);
+  return layers;
+}
+
+/** \brief the floats of every parameter of bert-base */
+std::vector<int> BertBase() {
+  const int h = 768, ffn = 3072;
+  std::vector<int> layers = {30522 * h, 512 * h, 2 * h, h, h};
+  for (int l = 0; l < 12; ++l) {
+    for (int i = 0; i < 4; ++i) { layers.push_back(h * h); layers.push_back(h); }
+    layers.push_back(h); layers.push_back(h);
+    layers.push_back(h * ffn); layers.push_back(ffn);
+    layers.push_back(ffn * h); layers.push_back(h);
+    layers.push_back(h); layers.push_back(h);
+  }
+  layers.push_back(h * h);
+  layers.push_back(h);
+  return layers;
+}
+
+std::vector<int> Model(const std::string& name, int scale) {
+  std::vector<int> layers;
+  int n = 0, len = 0;
+  if (name == "resnet50") {
+    layers = ResNet50();
+  } else if (name == "bert-base") {
+    layers = BertBase();
+  } else if (sscanf(name.c_str(), "uniform:%dx%d", &n, &len) == 2) {
+    layers.assign(n, len);
+  } else {
+    LOG(FATAL) << "unknown model " << name;
+  }
+  for (auto& l : layers) l = std::max(1, l / std::max(1, scale));
+  return layers;
+}
+
+/** \brief sums the pushes of every key */
+class Server {
+ public:
+  void Handle(const KVMeta& req, const KVPairs<char>& data, KVServer<char>* server) {
+    auto start = Clock::now();
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      if (!pushes_) first_ = start;
+      size_t offset = 0;
+      for (size_t i = 0; req.push && i < data.keys.size(); ++i) {
+        size_t bytes = data.lens.size() ? data.lens[i] : data.vals.size();
+        const float* v = reinterpret_cast<const float*>(data.vals.data() + offset);
+        std::vector<float>& stored = store_[data.keys[i]];
+        stored.resize(bytes / sizeof(float), 0);
+        for (size_t j = 0; j < stored.size(); ++j) stored[j] += v[j];
+        offset += bytes;
+      }
+      if (req.push) ++pushes_;
+    }
+    server->Response(req);
+    std::lock_guard<std::mutex> lk(mu_);
+    last_ = Clock::now();
+    handle_sec_ += Seconds(start, last_);
+  }
+
+  /** \brief log what the server went through, after Finalize */
+  void Report(int rank) {
+    double user, sys;
+    CpuTime(&user, &sys);
+    double sec = std::max(Seconds(first_, last_), 1e-9);
+    Van::BlockStats stats = Postoffice::Get()->van()->GetBlockStats();
+    std::vector<size_t> dropped = Postoffice::Get()->van()->udp_dropped();
+    size_t on_time = 0, late = 0;
+    for (size_t c = 0; c < stats.on_time.size(); ++c) {
+      on_time += stats.on_time[c];
+      late += stats.late[c];
+      size_t lost = c > 0 && c <= dropped.size() ? dropped[c - 1] : 0;
+      LL << "server " << rank << " channel " << c << (c ? " (udp)" : " (tcp)")
+         << ": " << stats.on_time[c] << " blocks on time, " << stats.late[c]
+         << " late, " << lost << " dropped, goodput "
+         << stats.on_time_bytes[c] / sec / 1e6 << " MB/s";
+    }
+    size_t total = on_time + stats.recovered + stats.missing;
+    LL << "server " << rank << ": " << pushes_ << " pushes in " << sec
+       << " sec, reassembly " << 100.0 * (on_time + stats.recovered) / std::max<size_t>(total, 1)
+       << "% complete (" << stats.recovered << " blocks recovered, "
+       << stats.missing << " missing, " << late << " late)";
+    LL << "server " << rank << " cpu: handle " << handle_sec_ << " sec, process user "
+       << user << " sec, sys " << sys << " sec";
+  }
+
+ private:
+  std::mutex mu_;
+  std::unordered_map<Key, std::vector<float>> store_;
+  size_t pushes_ = 0;
+  double handle_sec_ = 0;
+  Clock::time_point first_, last_;
+};
+
+void RunWorker(const std::vector<int>& layers, int iterations) {
+  KVWorker<char> kv(0, 0);
+  int rank = MyRank();
+  // spread the layers over the servers the way the kvstore does. the last
+  // layer is pushed first, it gets key 0 which marks a new iteration for the
+  // DGT ranking
+  const auto& ranges = Postoffice::Get()->GetServerKeyRanges();
+  std::mt19937 rng(rank + 1);
+  std::vector<SArray<Key>> keys(layers.size());
+  std::vector<SArray<char>> vals(layers.size());
+  std::vector<SArray<int>> lens(layers.size());
+  size_t bytes = 0;
+  for (size_t l = 0; l < layers.size(); ++l) {
+    size_t p = layers.size() - 1 - l;
+    keys[l].push_back(ranges[p % ranges.size()].begin() + p);
+    // layers are of very different magnitudes, which is what DGT ranks on
+    float scale = std::pow(10.0f, std::uniform_real_distribution<float>(-4, -1)(rng));
+    std::normal_distribution<float> grad(0, scale);
+    vals[l].resize(layers[l] * sizeof(float));
+    float* v = reinterpret_cast<float*>(vals[l].data());
+    for (int i = 0; i < layers[l]; ++i) v[i] = grad(rng);
+    lens[l].push_back(vals[l].size());
+    bytes += vals[l].size();
+  }
+
+  std::vector<double> latency, front;
+  double push_sec = 0, wait_sec = 0;
+  std::vector<int> ts(layers.size());
+  for (int it = 0; it < iterations; ++it) {
+    auto start = Clock::now();
+    for (size_t p = 0; p < layers.size(); ++p) {
+      int l = layers.size() - 1 - p;
+      ts[l] = kv.ZPush(keys[l], vals[l], lens[l], 0, nullptr, -l);
+    }
+    auto pushed = Clock::now();
+    kv.Wait(ts[0]);
+    auto first = Clock::now();
+    for (int t : ts) kv.Wait(t);
+    auto end = Clock::now();
+    // the first push goes whole over tcp, it is not a DGT one
+    if (it == 0) continue;
+    latency.push_back(Seconds(start, end) * 1e3);
+    front.push_back(Seconds(start, first) * 1e3);
+    push_sec += Seconds(start, pushed);
+    wait_sec += Seconds(pushed, end);
+    if (Postoffice::Get()->verbose()) LL << "worker " << rank << " iteration " << it << ": "
+                                         << latency.back() << " ms";
+  }
+  if (latency.empty()) return;
+  double user, sys;
+  CpuTime(&user, &sys);
+  std::vector<double> sorted(latency);
+  std::sort(sorted.begin(), sorted.end());
+  double mean = 0, front_mean = 0;
+  for (double l : latency) mean += l;
+  mean /= latency.size();
+  for (double l : front) front_mean += l;
+  front_mean /= front.size();
+  std::sort(front.begin(), front.end());
+  LL << "worker " << rank << ": " << layers.size() << " layers, " << bytes / 1e6
+     << " MB per iteration, push latency mean " << mean << " ms, p50 "
+     << sorted[sorted.size() / 2] << " ms, p99 "
+     << sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)]
+     << " ms, max " << sorted.back() << " ms";
+  LL << "worker " << rank << ": first layer pushed after " << front_mean
+     << " ms on average, p50 " << front[front.size() / 2] << " ms, "
+     << 100 * front_mean / mean << "% of the iteration";
+  LL << "worker " << rank << " cpu: push calls " << push_sec * 1e3 / latency.size()
+     << " ms/iter, waiting " << wait_sec * 1e3 / latency.size()
+     << " ms/iter, process user " << user << " sec, sys " << sys << " sec";
+}
+
+/** \brief start every node as a child process, and wait for them */
+int Launch(char* argv[]) {
+  const char* defaults[][2] = {
+    {"DMLC_NUM_SERVER", "1"}, {"DMLC_NUM_WORKER", "2"},
+    {"DMLC_PS_ROOT_URI", "127.0.0.1"}, {"DMLC_PS_ROOT_PORT", "8000"},
+    {"DMLC_NODE_HOST", "127.0.0.1"}, {"DMLC_UDP_CHANNEL_NUM", "2"},
+    {"ENABLE_DGT", "1"}, {"DGT_ENABLE_BLOCK", "1"}, {"DGT_BLOCK_SIZE", "4096"},
+    {"DGT_RECONSTRUCT", "1"}, {"DGT_REASSEMBLY_DEADLINE_US", "2000"},
+    {"DMLC_K", "0.5"}, {"DMLC_K_MIN", "0.2"}, {"ADAPTIVE_K_FLAG", "0"},
+    {"DGT_ENABLE_SEND_DROP", "0"}, {"ENABLE_ENCODE", "0"}, {"NS_DELAY", "0"},
+  };
+  for (const auto& d : defaults) setenv(d[0], d[1], 0);
+  std::vector<std::string> roles = {"scheduler"};
+  roles.insert(roles.end(), atoi(getenv("DMLC_NUM_SERVER")), "server");
+  roles.insert(roles.end(), atoi(getenv("DMLC_NUM_WORKER")), "worker");
+  std::vector<pid_t> pids;
+  for (const auto& role : roles) {
+    pid_t pid = fork();
+    CHECK_NE(pid, -1) << strerror(errno);
+    if (pid == 0) {
+      setenv("DMLC_ROLE", role.c_str(), 1);
+      execv("/proc/self/exe", argv);
+      _exit(127);
+    }
+    pids.push_back(pid);
+  }
+  int ret = 0;
+  for (size_t done = 0; done < pids.size(); ++done) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid == -1) break;
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+      LOG(ERROR) << roles[std::find(pids.begin(), pids.end(), pid) - pids.begin()]
+                 << " " << pid << " failed, stopping the others";
+      for (pid_t p : pids) kill(p, SIGTERM);
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
+int main(int argc, char *argv[]) {
+  if (!getenv("DMLC_ROLE")) return Launch(argv);
+  std::string model = argc > 1 ? argv[1] : "resnet50";
+  int iterations = argc > 2 ? atoi(argv[2]) : 10;
+  int scale = argc > 3 ? atoi(argv[3]) : 1;
+  std::vector<int> layers = Model(model, scale);
+
+  Start(0);
+  Server handle;
+  int rank = MyRank();
+  bool is_server = IsServer();
+  if (is_server) {
+    auto server = new KVServer<char>(0);
+    server->set_request_handle([&handle](const KVMeta& req, const KVPairs<char>& data,
+                                         KVServer<char>* s) { handle.Handle(req, data, s); });
+    RegisterExitCallback([server]() { delete server; });
+  }
+  if (IsWorker()) RunWorker(layers, iterations + 1);
+  Finalize(0, true);
+  if (is_server) handle.Report(rank);
+  return 0;
+}
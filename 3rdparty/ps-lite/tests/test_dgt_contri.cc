@@ -0,0 +1,120 @@
+/**
+ * \brief checks and times the |x| sum of the DGT block contributions
+ *
+ * Checks that every SIMD kernel the cpu runs gives the sum of the scalar one,
+ * on all short lengths, odd long ones and unaligned starts, so that the tails
+ * are covered. Then evaluates the EMA contribution of all blocks of all keys,
+ * the way KVWorker::Send does before ranking them, with the scalar kernel as
+ * the baseline and with AbsSum, and reports the time per iteration.
+ *
+ * usage: test_dgt_contri [num_keys] [floats_per_key] [block_size] [iterations]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/simd.h"
+using namespace ps;
+
+const float kAlpha = 0.3;
+
+typedef float (*Kernel)(const float*, size_t);
+
+/** \brief the per-key flat arrays KVWorker uses, summing with \a kernel */
+struct FlatContri {
+  explicit FlatContri(Kernel kernel) : kernel(kernel) { }
+  Kernel kernel;
+  std::unordered_map<int, std::vector<float>> contri;
+  std::unordered_map<int, float> contri_max;
+
+  float EvaluateKey(int key, const float* pd, int len, int block_len) {
+    int seq_num = (len + block_len - 1) / block_len;
+    std::vector<float>& key_contri = contri[key];
+    if (key_contri.size() != static_cast<size_t>(seq_num)) key_contri.assign(seq_num, 0.0);
+    float key_max = 0.0, sum = 0.0;
+    for (int seq = 0; seq < seq_num; ++seq) {
+      int nlen = std::min(block_len, len - seq * block_len);
+      float N = kernel(pd + seq * block_len, nlen);
+      float c = key_contri[seq] = kAlpha * key_contri[seq] + (1-kAlpha)*(N/nlen);
+      key_max = std::max(key_max, c);
+      sum += c;
+    }
+    contri_max[key] = key_max;
+    return sum;
+  }
+};
+
+/** \brief check \a kernel against AbsSumScalar on lengths and offsets with tails */
+void CheckKernel(const char* name, Kernel kernel) {
+  std::vector<float> x(5000);
+  for (auto& v : x) v = (rand() % 2001 - 1000) / 1e3;
+  std::vector<size_t> lens;
+  for (size_t n = 0; n <= 100; ++n) lens.push_back(n);
+  for (size_t n : {127, 255, 257, 1023, 1025, 4095, 4097}) lens.push_back(n);
+  for (size_t n : lens) {
+    for (size_t offset = 0; offset < 4; ++offset) {
+      const float* p = x.data() + offset;
+      double ref = 0;
+      for (size_t i = 0; i < n; ++i) ref += std::fabs(p[i]);
+      float scalar = AbsSumScalar(p, n);
+      float simd = kernel(p, n);
+      // both sum in float, in different orders, within n rounding errors
+      double tol = 1e-7 * n * ref + 1e-6;
+      CHECK_LE(std::fabs(scalar - ref), tol) << "scalar, n = " << n;
+      CHECK_LE(std::fabs(simd - ref), tol)
+          << name << " is " << simd << " instead of " << scalar
+          << ", n = " << n << ", offset = " << offset;
+    }
+  }
+  LL << name << " matches the scalar sum";
+}
+
+double Run(int iterations, const std::function<float()>& iteration) {
+  float sink = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iterations; ++i) sink += iteration();
+  auto end = std::chrono::high_resolution_clock::now();
+  CHECK(!std::isnan(sink));
+  return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  int num_keys = argc > 1 ? atoi(argv[1]) : 100;
+  int len = argc > 2 ? atoi(argv[2]) : 1 << 18;
+  int block_size = argc > 3 ? atoi(argv[3]) : 1024;
+  int iterations = argc > 4 ? atoi(argv[4]) : 10;
+  int block_len = block_size / sizeof(float);
+  int seq_num = (len + block_len - 1) / block_len;
+
+#ifdef PS_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) CheckKernel("AbsSumAVX2", AbsSumAVX2);
+  if (__builtin_cpu_supports("avx512f")) CheckKernel("AbsSumAVX512", AbsSumAVX512);
+#endif
+  CheckKernel("AbsSum", AbsSum);
+
+  std::vector<float> grad(len);
+  for (auto& g : grad) g = (rand() % 2001 - 1000) / 1e4;
+
+  auto timing = [&](Kernel kernel) {
+    FlatContri flat_contri(kernel);
+    return Run(iterations, [&]() {
+        float sum = 0;
+        for (int key = 0; key < num_keys; ++key) {
+          sum += flat_contri.EvaluateKey(key, grad.data(), len, block_len);
+        }
+        return sum;
+      });
+  };
+  double scalar_ms = timing(AbsSumScalar);
+  double simd_ms = timing(AbsSum);
+
+  LL << num_keys << " keys x " << seq_num << " blocks of " << block_size
+     << " bytes: scalar " << scalar_ms << " ms/iter, simd "
+     << simd_ms << " ms/iter (" << scalar_ms / simd_ms << "x)";
+  return 0;
+}
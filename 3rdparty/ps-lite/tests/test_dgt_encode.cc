@@ -0,0 +1,93 @@
+/**
+ * \brief checks and benchmarks the quantization of Van::encode / decode
+ *
+ * For 1, 2, 4 and 8 bits, quantizes a random gradient the way Van::encode
+ * does, checks that the SIMD kernel matches the plain C++ one when rounding
+ * to the nearest level, that the values decode back within half a step, and
+ * that stochastic rounding is unbiased. Reports the encode and decode rates
+ * in GB/s of floats on one core.
+ *
+ * usage: test_dgt_encode [num_floats] [iterations]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/quantize.h"
+using namespace ps;
+
+double Run(int iterations, const std::function<void()>& iteration) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iterations; ++i) iteration();
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double>(end - start).count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? atoi(argv[1]) : 1 << 20;
+  int iterations = argc > 2 ? atoi(argv[2]) : 20;
+  srand(0);
+  std::vector<float> grad(n);
+  for (auto& g : grad) g = (rand() % 20001 - 10000) / 1e5;
+  float min, max;
+  MinMax(grad.data(), n, &min, &max);
+  float lo, hi;
+  MinMaxScalar(grad.data(), n, &lo, &hi);
+  CHECK_EQ(min, lo);
+  CHECK_EQ(max, hi);
+
+  for (int bits : {1, 2, 4, 8}) {
+    QuantizeParam p;
+    p.bits = bits;
+    p.min = min;
+    p.step = (max - min) / ((1 << bits) - 1);
+    size_t bytes = QuantizedBytes(n, bits);
+
+    // nearest: the kernels agree and decode within half a step
+    std::vector<float> v(grad), v_scalar(grad), decoded(n);
+    std::vector<char> out(bytes), out_scalar(bytes);
+    Quantize(v.data(), n, p, out.data());
+    QuantizeScalar(v_scalar.data(), n, p, out_scalar.data());
+    CHECK(out == out_scalar) << bits << " bits: kernels disagree";
+    CHECK(v == v_scalar) << bits << " bits: residuals disagree";
+    Dequantize(out.data(), n, p, decoded.data());
+    for (size_t i = 0; i < n; ++i) {
+      CHECK_LE(std::fabs(decoded[i] - grad[i]), p.step / 2 * 1.001 + 1e-6)
+          << bits << " bits, value " << i;
+      CHECK_LE(std::fabs(grad[i] - decoded[i] - v[i]), 1e-6);
+    }
+    std::vector<float> decoded_scalar(n);
+    DequantizeScalar(out.data(), n, p, decoded_scalar.data());
+    CHECK(decoded == decoded_scalar) << bits << " bits: decoders disagree";
+
+    // stochastic: the errors cancel out
+    p.seed = 12345;
+    v = grad;
+    Quantize(v.data(), n, p, out.data());
+    double bias = 0;
+    for (size_t i = 0; i < n; ++i) bias += v[i];
+    CHECK_LE(std::fabs(bias / n), 5 * p.step / std::sqrt(n)) << bits << " bits: biased";
+
+    p.seed = 0;
+    double encode_sec = Run(iterations, [&]() {
+        v = grad;
+        Quantize(v.data(), n, p, out.data());
+      });
+    double copy_sec = Run(iterations, [&]() { v = grad; });
+    double decode_sec = Run(iterations, [&]() {
+        Dequantize(out.data(), n, p, decoded.data());
+      });
+    double scalar_sec = Run(iterations, [&]() {
+        v = grad;
+        QuantizeScalar(v.data(), n, p, out.data());
+      });
+    double gb = n * sizeof(float) / 1e9;
+    LL << bits << " bits: encode " << gb / std::max(encode_sec - copy_sec, 1e-9)
+       << " GB/s (plain C++ " << gb / std::max(scalar_sec - copy_sec, 1e-9)
+       << "), decode " << gb / decode_sec << " GB/s";
+  }
+  return 0;
+}
@@ -0,0 +1,99 @@
+/**
+ * \brief checks the loss and delay the van injects on the DGT udp channels
+ *
+ * Draws the faults of a few senders on a few channels the way
+ * Van::Receiving_UDP does, and checks that a seed gives every sender the same
+ * losses however the senders interleave, that the loss rate and the delays
+ * are the configured ones, and that the delay line hands the datagrams on in
+ * the order they fall due.
+ *
+ * usage: test_dgt_fault [datagrams] [drop_percent]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/fault.h"
+using namespace ps;
+
+const int kChannels = 3;
+const int kSenders = 4;
+const int kDelayUs = 500;
+const int kJitterUs = 200;
+
+/** \brief which of n datagrams of every sender and channel are lost */
+std::vector<bool> Losses(double drop, unsigned seed, int n, bool interleave) {
+  FaultInjector faults;
+  faults.Resize(kChannels);
+  for (int c = 0; c < kChannels; ++c) faults.Set(c, drop, kDelayUs, kJitterUs);
+  faults.Seed(seed);
+  std::vector<bool> lost(kChannels * kSenders * n);
+  FaultInjector::Clock::time_point due;
+  auto draw = [&](int c, int s, int i) {
+    auto now = FaultInjector::Clock::now();
+    bool dropped = faults.Draw(c, s, &due);
+    lost[(c * kSenders + s) * n + i] = dropped;
+    if (dropped) return;
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(due - now).count();
+    CHECK_GE(us, kDelayUs);
+    // the clock moves on between now and the draw
+    CHECK_LE(us, kDelayUs + kJitterUs + 1000);
+  };
+  if (interleave) {
+    srand(seed);
+    std::vector<int> next(kChannels * kSenders, 0);
+    for (int left = kChannels * kSenders * n; left > 0; --left) {
+      int k;
+      do { k = rand() % next.size(); } while (next[k] == n);
+      draw(k / kSenders, k % kSenders, next[k]++);
+    }
+  } else {
+    for (int c = 0; c < kChannels; ++c) {
+      for (int s = 0; s < kSenders; ++s) {
+        for (int i = 0; i < n; ++i) draw(c, s, i);
+      }
+    }
+  }
+  size_t dropped = 0;
+  for (size_t d : faults.dropped()) dropped += d;
+  CHECK_EQ(dropped, static_cast<size_t>(std::count(lost.begin(), lost.end(), true)));
+  return lost;
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 10000;
+  double drop = (argc > 2 ? atof(argv[2]) : 5) / 100;
+
+  std::vector<bool> lost = Losses(drop, 42, n, false);
+  CHECK(lost == Losses(drop, 42, n, true)) << "the losses depend on the interleaving";
+  double rate = std::count(lost.begin(), lost.end(), true) / static_cast<double>(lost.size());
+  CHECK_LE(std::fabs(rate - drop), 5 * std::sqrt(drop * (1 - drop) / lost.size()) + 1e-9)
+      << "lost " << rate << " instead of " << drop;
+  // the seeds, senders and channels do not lose the same datagrams
+  if (drop > 0 && drop < 1) {
+    CHECK(lost != Losses(drop, 43, n, false)) << "the losses do not depend on the seed";
+    CHECK(!std::equal(lost.begin(), lost.begin() + n, lost.begin() + n));
+  }
+
+  DelayLine<int> line;
+  std::vector<int> order;
+  std::thread popper([&]() {
+      int i;
+      while (line.Pop(&i)) order.push_back(i);
+    });
+  auto start = DelayLine<int>::Clock::now();
+  for (int i = 0; i < 20; ++i) {
+    line.Push(start + std::chrono::milliseconds(20 - i), i);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  line.Stop();
+  popper.join();
+  CHECK_EQ(order.size(), 20U);
+  for (int i = 0; i < 20; ++i) CHECK_EQ(order[i], 19 - i);
+
+  LL << lost.size() << " datagrams, " << rate * 100 << "% lost, the same for any interleaving";
+  return 0;
+}
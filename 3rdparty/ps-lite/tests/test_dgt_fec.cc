@@ -0,0 +1,72 @@
+/**
+ * \brief checks the Reed-Solomon code of the DGT udp channels
+ *
+ * Builds random stripes the way Van::AddToStripe does, drops up to M of their
+ * blocks, solves them back from random parities the way Van::RecoverStripes
+ * does, and reports the encoding rate.
+ *
+ * usage: test_dgt_fec [iterations] [block_size]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/fec.h"
+using namespace ps;
+
+int main(int argc, char *argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+  int block_size = argc > 2 ? atoi(argv[2]) : 4096;
+  srand(0);
+  size_t encoded = 0;
+  double encode_sec = 0;
+  for (int it = 0; it < iterations; ++it) {
+    int n = rand() % 32 + 1, m = rand() % 4 + 1;
+    int len = rand() % block_size + 1;
+    std::vector<std::vector<char>> data(n, std::vector<char>(len));
+    for (auto& block : data) {
+      for (auto& c : block) c = rand();
+    }
+    std::vector<std::vector<char>> parity(m, std::vector<char>(len, 0));
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < n; ++i) {
+      for (int j = 0; j < m; ++j) {
+        ReedSolomon::MulAdd(ReedSolomon::Coef(j, i), data[i].data(), len,
+                            parity[j].data());
+      }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    encode_sec += std::chrono::duration<double>(end - start).count();
+    encoded += static_cast<size_t>(n) * len;
+
+    // lose k blocks and solve them from k of the parities
+    int k = rand() % std::min(n, m) + 1;
+    std::vector<int> order(n), rows(m);
+    for (int i = 0; i < n; ++i) order[i] = i;
+    for (int j = 0; j < m; ++j) rows[j] = j;
+    std::random_shuffle(order.begin(), order.end());
+    std::random_shuffle(rows.begin(), rows.end());
+    std::vector<int> lost(order.begin(), order.begin() + k);
+    std::sort(lost.begin(), lost.end());
+    rows.resize(k);
+    std::vector<char*> blocks;
+    for (int r : rows) {
+      for (int i = 0; i < n; ++i) {
+        if (std::binary_search(lost.begin(), lost.end(), i)) continue;
+        ReedSolomon::MulAdd(ReedSolomon::Coef(r, i), data[i].data(), len,
+                            parity[r].data());
+      }
+      blocks.push_back(parity[r].data());
+    }
+    ReedSolomon::Solve(rows, lost, blocks, len);
+    for (int l = 0; l < k; ++l) {
+      CHECK(std::equal(data[lost[l]].begin(), data[lost[l]].end(), blocks[l]))
+          << "stripe " << it << " (" << n << "+" << m << ") lost block "
+          << lost[l];
+    }
+  }
+  LL << iterations << " stripes recovered, encoding "
+     << encoded / encode_sec / 1e6 << " MB/s";
+  return 0;
+}
@@ -0,0 +1,118 @@
+/**
+ * \brief microbenchmark of the DGT send queues
+ *
+ * Several engine-like threads push block messages, built the way
+ * KVWorker::Send builds them, into the queue that feeds a DGT scheduler
+ * thread (Van::Classifier -> Important_scheduler), while one consumer drains
+ * it. Reports blocks/sec for the mutex queue and for the lock-free ring, and
+ * for the ring feeding the priority order of DGT_SEND_PRIORITY, which it
+ * checks sends higher priorities first and the blocks of a key in order.
+ *
+ * usage: test_dgt_queue [num_threads] [blocks_per_thread] [block_size]
+ */
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/message.h"
+#include "ps/internal/mpsc_queue.h"
+#include "ps/internal/send_heap.h"
+#include "ps/internal/threadsafe_queue.h"
+using namespace ps;
+
+Message MakeBlock(const SArray<Key>& keys, const SArray<char>& vals,
+                  const SArray<int>& lens, int seq, int seq_end) {
+  Message msg;
+  msg.meta.request = true;
+  msg.meta.push = true;
+  msg.meta.msg_type = 2;
+  msg.meta.first_key = keys[0];
+  msg.meta.seq = seq;
+  msg.meta.seq_end = seq_end;
+  msg.AddData(keys);
+  msg.AddData(vals);
+  msg.AddData(lens);
+  return msg;
+}
+
+double Run(int num_threads, int num_blocks, int block_size,
+           const std::function<void(Message)>& push,
+           const std::function<size_t()>& pop) {
+  SArray<Key> keys(1, 0);
+  SArray<char> vals(block_size, 1);
+  SArray<int> lens(1, block_size);
+  size_t total = static_cast<size_t>(num_threads) * num_blocks;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  std::thread consumer([&]() {
+      size_t n = 0;
+      while (n < total) n += pop();
+    });
+  std::vector<std::thread> producers;
+  for (int t = 0; t < num_threads; ++t) {
+    producers.emplace_back([&, t]() {
+        for (int i = 0; i < num_blocks; ++i) {
+          push(MakeBlock(keys, vals, lens, i, num_blocks - 1));
+        }
+      });
+  }
+  for (auto& p : producers) p.join();
+  consumer.join();
+  auto end = std::chrono::high_resolution_clock::now();
+  double sec = std::chrono::duration<double>(end - start).count();
+  return total / sec;
+}
+
+int main(int argc, char *argv[]) {
+  int num_threads = argc > 1 ? atoi(argv[1]) : 4;
+  int num_blocks = argc > 2 ? atoi(argv[2]) : 200000;
+  int block_size = argc > 3 ? atoi(argv[3]) : 4096;
+
+  ThreadsafeQueue<Message> locked;
+  double locked_rate = Run(num_threads, num_blocks, block_size,
+      [&](Message msg) { locked.Push(std::move(msg)); },
+      [&]() { Message msg; locked.WaitAndPop(&msg); return 1; });
+
+  MPSCQueue<Message> ring;
+  std::vector<Message> batch;
+  double ring_rate = Run(num_threads, num_blocks, block_size,
+      [&](Message msg) { ring.Push(std::move(msg)); },
+      [&]() { return ring.WaitAndPopBatch(&batch, 64); });
+
+  SendHeap heap;
+  double heap_rate = Run(num_threads, num_blocks, block_size,
+      [&](Message msg) { ring.Push(std::move(msg)); },
+      [&]() {
+        size_t n = ring.WaitAndPopBatch(&batch, 64);
+        for (auto& msg : batch) heap.Push(std::move(msg));
+        batch.clear();
+        heap.PopBatch(&batch, 64);
+        return n;
+      });
+  CHECK(heap.empty());
+
+  // the backward pass pushes the last layer first
+  SArray<char> vals(16);
+  SArray<int> lens(1, 16);
+  for (int k = 3; k >= 0; --k) {
+    for (int seq = 0; seq < 3; ++seq) {
+      Message msg = MakeBlock(SArray<Key>(1, k), vals, lens, seq, 2);
+      msg.meta.priority = -k;
+      heap.Push(std::move(msg));
+    }
+  }
+  batch.clear();
+  CHECK_EQ(heap.PopBatch(&batch, 100), 12U);
+  for (int i = 0; i < 12; ++i) {
+    CHECK_EQ(batch[i].meta.first_key, i / 3);
+    CHECK_EQ(batch[i].meta.seq, i % 3);
+  }
+
+  LL << num_threads << " threads, " << block_size << " bytes/block: "
+     << "ThreadsafeQueue " << locked_rate << " blocks/sec, "
+     << "MPSCQueue " << ring_rate << " blocks/sec ("
+     << ring_rate / locked_rate << "x), by priority " << heap_rate << " blocks/sec";
+  return 0;
+}
@@ -3084,6 +3084,18 @@ MXNET_DLL int MXKVStoreBarrier(KVStoreHandle handle);
 MXNET_DLL int MXKVStoreSetBarrierBeforeExit(KVStoreHandle handle,
                                             const int barrier_before_exit);
 
+/**
+ * \brief report a scalar training signal, such as the loss, to the worker
+ *
+ * \param handle handle to the KVStore
+ * \param name the name of the signal, "loss" drives the adaptive K of DGT
+ * \param value its current value
+ * \return 0 when success, -1 when failure happens
+ */
+MXNET_DLL int MXKVStoreReportSignal(KVStoreHandle handle,
+                                    const char* name,
+                                    float value);
+
 /**
  * \brief the prototype of a server controller
  * \param head the head of the command
@@ -418,6 +418,17 @@ class KVStore {
    */
   virtual void Barrier() { }
 
+  /*!
+   * \brief report a scalar training signal, such as the loss, to the worker
+   *
+   * The signal named "loss" drives the adaptive K of DGT. Does nothing unless
+   * the kvstore is distributed.
+   *
+   * \param name the name of the signal
+   * \param value its current value
+   */
+  virtual void ReportSignal(const std::string& name, float value) { }
+
   /**
    * \brief Send a command to all server nodes
    *
@@ -552,6 +552,24 @@ class KVStore(KVStoreBase):
         else:
             raise Exception('Gradient compression is not supported for this type of kvstore')
 
+    def report_signal(self, name, value):
+        """ Reports a scalar training signal, such as the loss, to the kvstore.
+
+        With a 'dist' kvstore the signal named `loss` drives the adaptive K of
+        DGT, which otherwise polls it from /tmp/loss<node id>.csv. Report it
+        once per iteration, before the gradients are pushed. Other types of
+        kvstore ignore the signal.
+
+        Parameters
+        ----------
+        name : str
+            The name of the signal.
+        value : float
+            Its current value.
+        """
+        check_call(_LIB.MXKVStoreReportSignal(self.handle, c_str(name),
+                                              ctypes.c_float(value)))
+
     def set_optimizer(self, optimizer):
         """ Registers an optimizer with the kvstore.
 
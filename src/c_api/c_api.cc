@@ -2833,6 +2833,14 @@ int MXKVStoreSetBarrierBeforeExit(KVStoreHandle handle,
   API_END();
 }
 
+int MXKVStoreReportSignal(KVStoreHandle handle,
+                          const char* name,
+                          float value) {
+  API_BEGIN();
+  static_cast<KVStore*>(handle)->ReportSignal(name, value);
+  API_END();
+}
+
 int MXInitPSEnv(uint32_t num_vars,
                 const char **keys,
                 const char **vals) {
@@ -27,6 +27,15 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <mutex>
+#include <thread>
+#include <tuple>
 #include <utility>
 #include "./kvstore_local.h"
 #include "mxnet/engine.h"
@@ -40,6 +49,202 @@
 namespace mxnet {
 namespace kvstore {
 
+/**
+ * \brief packs the pushes and pulls of small keys bound for the same server
+ * into one request of several keys, which KVStoreDistServer::DataHandleBatch
+ * takes apart again
+ *
+ * A batch is sent once it holds max_bytes, or window_us after its first key.
+ * The keys are grouped by key modulo DGT_SERVER_THREADS as well, so that the
+ * server thread handling a batch is the one owning all its keys.
+ */
+class KeyCoalescer {
+ public:
+  typedef std::function<void()> Callback;
+
+  KeyCoalescer(ps::KVWorker<char>* worker, int window_us, size_t max_bytes)
+      : worker_(worker), window_us_(window_us), max_bytes_(max_bytes) {
+    server_threads_ = std::max(1, dmlc::GetEnv("DGT_SERVER_THREADS", 1));
+    ranges_ = ps::Postoffice::Get()->GetServerKeyRanges();
+    timer_ = std::thread(&KeyCoalescer::Timer, this);
+  }
+
+  /** \brief call it once the pushes and pulls added are done */
+  ~KeyCoalescer() {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      stop_ = true;
+    }
+    cond_.notify_one();
+    timer_.join();
+  }
+
+  /** \brief push \a vals to \a key with the next batch, see ps::KVWorker::ZPush */
+  void Push(ps::Key key, const ps::SArray<char>& vals, int cmd, int priority,
+            const Callback& cb) {
+    Entry e;
+    e.key = key;
+    e.vals = vals;
+    e.len = vals.size();
+    e.cb = cb;
+    Add(true, cmd, priority, std::move(e));
+  }
+
+  /** \brief pull \a key into \a vals, already sized, with the next batch */
+  void Pull(ps::Key key, ps::SArray<char>* vals, int cmd, int priority,
+            const Callback& cb) {
+    Entry e;
+    e.key = key;
+    e.out = vals;
+    e.len = vals->size();
+    e.cb = cb;
+    Add(false, cmd, priority, std::move(e));
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+  struct Entry {
+    ps::Key key;
+    ps::SArray<char> vals;
+    ps::SArray<char>* out = nullptr;
+    int len = 0;
+    Callback cb;
+  };
+  struct Batch {
+    bool push = true;
+    int cmd = 0;
+    int priority = 0;
+    size_t bytes = 0;
+    Clock::time_point start;
+    std::vector<Entry> entries;
+  };
+  /** (server, key modulo the server threads, cmd, push) */
+  typedef std::tuple<int, int, int, bool> Group;
+
+  void Add(bool push, int cmd, int priority, Entry&& e) {
+    std::vector<Batch> ready;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      Group g(Server(e.key), static_cast<int>(e.key % server_threads_), cmd, push);
+      auto it = open_.find(g);
+      if (it != open_.end()) {
+        // a request carries a key once
+        for (const Entry& o : it->second.entries) {
+          if (o.key != e.key) continue;
+          ready.push_back(std::move(it->second));
+          open_.erase(it);
+          break;
+        }
+      }
+      Batch& b = open_[g];
+      if (b.entries.empty()) {
+        b.push = push;
+        b.cmd = cmd;
+        b.priority = priority;
+        b.start = Clock::now();
+        cond_.notify_one();
+      }
+      b.priority = std::max(b.priority, priority);
+      b.bytes += e.len;
+      b.entries.push_back(std::move(e));
+      if (b.bytes >= max_bytes_) {
+        ready.push_back(std::move(b));
+        open_.erase(g);
+      }
+    }
+    for (auto& b : ready) Send(&b);
+  }
+
+  int Server(ps::Key key) const {
+    for (size_t i = 0; i < ranges_.size(); ++i) {
+      if (key >= ranges_[i].begin() && key < ranges_[i].end()) return i;
+    }
+    LOG(FATAL) << "key " << key << " belongs to no server";
+    return -1;
+  }
+
+  /** \brief send the batches whose first key waited window_us */
+  void Timer() {
+    std::unique_lock<std::mutex> lk(mu_);
+    while (!stop_) {
+      if (open_.empty()) {
+        cond_.wait(lk);
+        continue;
+      }
+      auto now = Clock::now();
+      auto next = Clock::time_point::max();
+      std::vector<Batch> ready;
+      for (auto it = open_.begin(); it != open_.end(); ) {
+        auto due = it->second.start + std::chrono::microseconds(window_us_);
+        if (due <= now) {
+          ready.push_back(std::move(it->second));
+          it = open_.erase(it);
+        } else {
+          next = std::min(next, due);
+          ++it;
+        }
+      }
+      if (ready.empty()) {
+        cond_.wait_until(lk, next);
+        continue;
+      }
+      lk.unlock();
+      for (auto& b : ready) Send(&b);
+      lk.lock();
+    }
+  }
+
+  void Send(Batch* b) {
+    std::sort(b->entries.begin(), b->entries.end(),
+              [](const Entry& x, const Entry& y) { return x.key < y.key; });
+    ps::SArray<ps::Key> keys;
+    ps::SArray<int> lens;
+    for (const auto& e : b->entries) {
+      keys.push_back(e.key);
+      lens.push_back(e.len);
+    }
+    auto entries = std::make_shared<std::vector<Entry>>(std::move(b->entries));
+    if (b->push) {
+      ps::SArray<char> vals;
+      if (entries->size() == 1) {
+        vals = entries->front().vals;
+      } else {
+        vals.reserve(b->bytes);
+        for (const auto& e : *entries) vals.append(e.vals);
+      }
+      worker_->ZPush(keys, vals, lens, b->cmd, [entries, vals]() {
+          for (auto& e : *entries) e.cb();
+        }, b->priority);
+    } else {
+      struct Pulled {
+        ps::SArray<char> vals;
+        ps::SArray<int> lens;
+      };
+      auto pulled = std::make_shared<Pulled>();
+      pulled->vals.resize(b->bytes);
+      worker_->ZPull(keys, &pulled->vals, &pulled->lens, b->cmd, [entries, pulled]() {
+          size_t offset = 0;
+          for (auto& e : *entries) {
+            memcpy(e.out->data(), pulled->vals.data() + offset, e.len);
+            offset += e.len;
+            e.cb();
+          }
+        }, b->priority);
+    }
+  }
+
+  ps::KVWorker<char>* worker_;
+  int window_us_;
+  size_t max_bytes_;
+  int server_threads_ = 1;
+  std::vector<ps::Range> ranges_;
+  std::map<Group, Batch> open_;
+  bool stop_ = false;
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::thread timer_;
+};
+
 /**
  * \brief distributed kvstore
  *
@@ -63,13 +268,21 @@ class KVStoreDist : public KVStoreLocal {
       }
     }
     bigarray_bound_ = dmlc::GetEnv("MXNET_KVSTORE_BIGARRAY_BOUND", 1000 * 1000);
+    balanced_placement_ = dmlc::GetEnv("MXNET_KVSTORE_BALANCED_PLACEMENT", false);
     log_verbose_ = dmlc::GetEnv("MXNET_KVSTORE_DIST_ROW_SPARSE_VERBOSE", false);
     msg_size_limit = dmlc::GetEnv("DGT_MSG_SIZE_LIMIT", 4 * 1024);
+    int coalesce_us = dmlc::GetEnv("MXNET_KVSTORE_COALESCE_US", 0);
+    if (IsWorkerNode() && coalesce_us > 0) {
+      coalesce_bytes_ = dmlc::GetEnv("MXNET_KVSTORE_COALESCE_BYTES", 16 * 1024);
+      coalescer_.reset(new KeyCoalescer(ps_worker_, coalesce_us, 64 * coalesce_bytes_));
+      coalesce_pushes_ = !dmlc::GetEnv("ENABLE_DGT", 0);
+    }
 //    std::cout << "node-1 msg_size_limit = " << msg_size_limit << std::endl;
   }
 
   virtual ~KVStoreDist() {
     Engine::Get()->WaitForAll();
+    coalescer_.reset();
     customer_id_ = 0;
     if (IsWorkerNode()) {
       if (barrier_before_exit_) {
@@ -115,6 +328,10 @@ class KVStoreDist : public KVStoreLocal {
     ps::Postoffice::Get()->Barrier(ps_worker_->get_customer()->customer_id(), ps::kWorkerGroup);
   }
 
+  void ReportSignal(const std::string& name, float value) override {
+    CHECK_NOTNULL(ps_worker_)->ReportSignal(name, value);
+  }
+
   void SendCommandToServers(int cmd_id,
                             const std::string& cmd_body) override {
     CHECK_NOTNULL(ps_worker_);
@@ -205,6 +422,7 @@ class KVStoreDist : public KVStoreLocal {
     for (size_t i = 0; i < keys.size(); ++i) {
       InitKV(keys[i], values[i]);
     }
+    if (balanced_placement_) PlaceKeys(keys, values);
     if (get_rank() == 0 && this->ps_worker_->get_customer()->customer_id() == 0) {
 	   // std::cout<<"node-1 dist InitImpl"<<std::endl;
       Push_(keys, values, 0, false);
@@ -225,6 +443,118 @@ class KVStoreDist : public KVStoreLocal {
     comm_->Init(key, value.storage_type(), value.shape(), value.dtype());
   }
 
+  /**
+   * \brief place the dense keys on the servers by their size, largest first:
+   * a small key on the server holding the fewest bytes, a big array split to
+   * fill up the least loaded servers to the same level. every worker inits
+   * the same keys in the same order, so they all place them the same way
+   */
+  void PlaceKeys(const std::vector<int>& keys, const std::vector<NDArray>& values) {
+    const int num_servers = ps::NumServers();
+    std::vector<size_t> order;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (values[i].storage_type() == kDefaultStorage) order.push_back(i);
+    }
+    auto bytes = [&values](size_t i) {
+      return values[i].shape().Size() * mshadow::mshadow_sizeof(values[i].dtype());
+    };
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return bytes(a) != bytes(b) ? bytes(a) > bytes(b) : keys[a] < keys[b];
+      });
+    std::lock_guard<std::mutex> lk(mu_);
+    server_bytes_.resize(num_servers, 0);
+    server_keys_.resize(num_servers, 0);
+    for (size_t i : order) {
+      const int key = keys[i];
+      const size_t num_elems = values[i].shape().Size();
+      const int num_bytes = mshadow::mshadow_sizeof(values[i].dtype());
+      std::vector<size_t>& parts = placement_[key];
+      parts.assign(num_servers, 0);
+      if (key == 0) {
+        // workers count the DGT iterations by the pushes of ps key 0, which
+        // key 0 keeps as before, on server 0 or split evenly
+        for (int s = 0; s < num_servers; ++s) {
+          parts[s] = num_elems < bigarray_bound_ ? (s == 0 ? num_elems : 0) :
+              static_cast<size_t>(round(static_cast<double>(num_elems) / num_servers * (s + 1))) -
+              static_cast<size_t>(round(static_cast<double>(num_elems) / num_servers * s));
+        }
+      } else if (num_elems < bigarray_bound_) {
+        parts[std::min_element(server_bytes_.begin(), server_bytes_.end()) -
+              server_bytes_.begin()] = num_elems;
+      } else {
+        FillServers(num_elems, num_bytes, &parts);
+      }
+      for (int s = 0; s < num_servers; ++s) {
+        server_bytes_[s] += parts[s] * num_bytes;
+        if (parts[s]) ++server_keys_[s];
+      }
+    }
+    if (get_rank() == 0 && order.size()) {
+      double mean = 0;
+      for (size_t b : server_bytes_) mean += b;
+      mean /= num_servers;
+      for (int s = 0; s < num_servers; ++s) {
+        LOG(INFO) << "server " << s << ": " << server_keys_[s] << " keys, "
+                  << server_bytes_[s] / 1e6 << " MB, "
+                  << (mean > 0 ? 100 * (server_bytes_[s] - mean) / mean : 0)
+                  << "% off the mean";
+      }
+    }
+  }
+
+  /**
+   * \brief split an array over the servers, the least loaded ones getting the
+   * elements that bring them to the same number of bytes. mu_ held
+   */
+  void FillServers(size_t num_elems, int num_bytes, std::vector<size_t>* parts) {
+    const int num_servers = server_bytes_.size();
+    std::vector<int> by_load(num_servers);
+    for (int s = 0; s < num_servers; ++s) by_load[s] = s;
+    std::sort(by_load.begin(), by_load.end(), [this](int a, int b) {
+        return server_bytes_[a] != server_bytes_[b] ? server_bytes_[a] < server_bytes_[b] : a < b;
+      });
+    // the number k of servers filled and their common level
+    double total = static_cast<double>(num_elems) * num_bytes;
+    double level = 0, sum = 0;
+    int k = 0;
+    while (k < num_servers) {
+      sum += server_bytes_[by_load[k]];
+      ++k;
+      level = (sum + total) / k;
+      if (k == num_servers || level <= server_bytes_[by_load[k]]) break;
+    }
+    size_t assigned = 0;
+    for (int j = 0; j < k; ++j) {
+      int s = by_load[j];
+      size_t n = static_cast<size_t>(std::max(0.0, (level - server_bytes_[s]) / num_bytes));
+      n = std::min(n, num_elems - assigned);
+      (*parts)[s] = n;
+      assigned += n;
+    }
+    // the rounding leftovers, at most one per server filled
+    for (int j = 0; assigned < num_elems; j = (j + 1) % k) {
+      ++(*parts)[by_load[j]];
+      ++assigned;
+    }
+  }
+
+  /**
+   * \brief the server of a key not split over several, placed by \ref
+   * PlaceKeys or else picked by the key
+   */
+  int SingleServer(const int key, const int num_servers) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = placement_.find(key);
+    if (it != placement_.end()) {
+      const std::vector<size_t>& parts = it->second;
+      if (std::count(parts.begin(), parts.end(), 0) == num_servers - 1) {
+        return std::find_if(parts.begin(), parts.end(), [](size_t n) { return n > 0; }) -
+            parts.begin();
+      }
+    }
+    return (key * 9973) % num_servers;
+  }
+
   void PushPullImpl(const std::vector<int>& vkeys,
                     const std::vector<int>& okeys,
                     const std::vector<NDArray>& values,
@@ -437,13 +767,15 @@ class KVStoreDist : public KVStoreLocal {
     gradient_compression_->Quantize(comm_buf, &small_buf, &res_buf, priority);
     //std::cout<<"PushCompressed ZPull"<<std::endl;
     auto push_to_servers =
-      [this, key, dtype, pskv, small_buf](RunContext rctx, Engine::CallbackOnComplete cb) {
+      [this, key, dtype, pskv, small_buf, priority](RunContext rctx,
+                                                    Engine::CallbackOnComplete cb) {
         size_t size = small_buf.shape().Size() * mshadow::mshadow_sizeof(dtype);
         char* data = static_cast<char *> (small_buf.data().dptr_);
         // do push. false means no delete
         ps::SArray<char> vals(data, size, false);
         int cmd = GetCommandType(RequestType::kCompressedPushPull, dtype);
-        CHECK_NOTNULL(ps_worker_)->ZPush(pskv.keys, vals, pskv.lens, cmd, [cb]() { cb(); });
+        CHECK_NOTNULL(ps_worker_)->ZPush(pskv.keys, vals, pskv.lens, cmd, [cb]() { cb(); },
+                                         priority);
       };
     // acquire locks on both comm_buf and small_buf so that
     // pull (which uses comm_buf) for the same key waits till push finishes
@@ -460,7 +792,7 @@ class KVStoreDist : public KVStoreLocal {
   virtual void PushDefault(int key, const NDArray &send_buf, const PSKV& pskv, int priority) {
 	  //std::cout<<"PushDefault ZPush"<<std::endl;
     auto push_to_servers =
-        [this, key, pskv, send_buf](RunContext rctx, Engine::CallbackOnComplete cb) {
+        [this, key, pskv, send_buf, priority](RunContext rctx, Engine::CallbackOnComplete cb) {
           const int dtype = send_buf.dtype();
           // convert to ps keys
           const size_t size = send_buf.shape().Size() * mshadow::mshadow_sizeof(dtype);
@@ -468,9 +800,14 @@ class KVStoreDist : public KVStoreLocal {
           // do push. false means no delete
           ps::SArray<char> vals(data, size, false);
           int cmd = GetCommandType(RequestType::kDefaultPushPull, dtype);
+          if (coalesce_pushes_ && pskv.keys.size() == 1 && size <= coalesce_bytes_) {
+            coalescer_->Push(pskv.keys[0], vals, cmd, priority, [cb]() { cb(); });
+            return;
+          }
+          // the van sends the front layers first with DGT_SEND_PRIORITY
           CHECK_NOTNULL(ps_worker_)->ZPush(
               pskv.keys, vals, pskv.lens,
-              cmd, [cb]() { cb(); });
+              cmd, [cb]() { cb(); }, priority);
         };
     Engine::Get()->PushAsync(
         push_to_servers,
@@ -516,7 +853,7 @@ class KVStoreDist : public KVStoreLocal {
   }
 
   virtual void PullDefault(int key, const NDArray &recv_buf, int priority) {
-    auto pull_from_servers = [this, key, recv_buf](
+    auto pull_from_servers = [this, key, recv_buf, priority](
         RunContext rctx, Engine::CallbackOnComplete cb) {
       // convert to ps keys
       size_t size = recv_buf.shape().Size();
@@ -532,9 +869,15 @@ class KVStoreDist : public KVStoreLocal {
       RequestType mode = (gradient_compression_->get_type() != CompressionType::kNone) ?
                 RequestType::kCompressedPushPull : RequestType::kDefaultPushPull;
       const int cmd = GetCommandType(mode, dtype);
+      // the server only takes apart default requests
+      if (coalescer_ && mode == RequestType::kDefaultPushPull && pskv.keys.size() == 1 &&
+          vals->size() <= coalesce_bytes_) {
+        coalescer_->Pull(pskv.keys[0], vals, cmd, priority, [vals, cb](){ delete vals; cb(); });
+        return;
+      }
       //std::cout<<"Node-1 PullDefault ZPull!"<<std::endl;
       CHECK_NOTNULL(ps_worker_)->ZPull(
-        pskv.keys, vals, &pskv.lens, cmd, [vals, cb](){ delete vals; cb(); });
+        pskv.keys, vals, &pskv.lens, cmd, [vals, cb](){ delete vals; cb(); }, priority);
     };
 
     CHECK_NOTNULL(Engine::Get())->PushAsync(
@@ -655,8 +998,28 @@ class KVStoreDist : public KVStoreLocal {
       const int num_servers = krs.size();
       CHECK_GT(num_servers, 0);
 
-      // a simple heuristic for load balance
-      if (num_arr_elems < bigarray_bound_) {
+      std::vector<size_t> parts;
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = placement_.find(key);
+        if (it != placement_.end()) parts = it->second;
+      }
+      if (parts.size()) {
+        // placed by size at init
+        CHECK_EQ(std::accumulate(parts.begin(), parts.end(), static_cast<size_t>(0)),
+                 num_arr_elems) << "The value size cannot be changed. Key is " << key;
+        pskv.size = 0;
+        for (int i = 0; i < num_servers; ++i) {
+          if (parts[i] == 0) continue;
+          ps::Key ps_key = krs[i].begin() + key;
+          CHECK_LT(ps_key, krs[i].end());
+          pskv.keys.push_back(ps_key);
+          const int total_bytes = parts[i] * num_bytes;
+          pskv.lens.push_back(total_bytes);
+          pskv.size += total_bytes;
+        }
+      } else if (num_arr_elems < bigarray_bound_) {
+        // a simple heuristic for load balance
         // send it to a single random picked server
         int server = (key * 9973) % num_servers;
         ps::Key ps_key = krs[server].begin() + key;
@@ -724,7 +1087,7 @@ class KVStoreDist : public KVStoreLocal {
       if (original_num_elem < bigarray_bound_) {
         // a simple heuristic for load balancing
         // send it to a single random picked server
-        const int server = (key * 9973) % num_servers;
+        const int server = SingleServer(key, num_servers);
         ps::Key ps_key = krs[server].begin() + key;
         CHECK_LT(ps_key, krs[server].end());
         // meta info
@@ -855,6 +1218,26 @@ class KVStoreDist : public KVStoreLocal {
    */
   size_t bigarray_bound_;
   int msg_size_limit;
+  /** \brief place the keys by size at init, MXNET_KVSTORE_BALANCED_PLACEMENT */
+  bool balanced_placement_ = false;
+  /** \brief key -> its number of elements on each server, see \ref PlaceKeys */
+  std::unordered_map<int, std::vector<size_t>> placement_;
+  /** \brief the bytes and number of keys placed on each server */
+  std::vector<size_t> server_bytes_;
+  std::vector<int> server_keys_;
+  /**
+   * \brief packs the small keys into batches, MXNET_KVSTORE_COALESCE_US. null
+   * if off
+   */
+  std::unique_ptr<KeyCoalescer> coalescer_;
+  /** \brief the largest key coalesced, in bytes, MXNET_KVSTORE_COALESCE_BYTES */
+  size_t coalesce_bytes_ = 0;
+  /**
+   * \brief whether pushes are coalesced too. not with ENABLE_DGT, whose per
+   * push state is kept by the first key of a request, and a batch formed by
+   * timing does not hold the same keys from one push to the next
+   */
+  bool coalesce_pushes_ = false;
   /**
    * \brief buffer for non-compressed data.
    * When gradient compression is active, this is used
@@ -34,6 +34,7 @@
 #include <memory>
 #include <functional>
 #include <future>
+#include <unordered_map>
 #include <vector>
 #include "../profiler/profiler.h"
 #include "../operator/tensor/elemwise_binary_op-inl.h"
@@ -161,6 +162,30 @@ class Executor {
   std::condition_variable cond_;
 };
 
+/**
+ * \brief a per key map the server threads of different keys share. looking
+ * up a key is threadsafe, the value found is only touched by the thread of
+ * its key
+ */
+template <typename V>
+class KeyMap {
+ public:
+  V& operator[](int key) {
+    std::lock_guard<std::mutex> lk(mu_);
+    return map_[key];
+  }
+  /** \brief call f(key, value) on every entry, no key can be added meanwhile */
+  template <typename F>
+  void ForEach(F f) {
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& entry : map_) f(entry.first, entry.second);
+  }
+
+ private:
+  std::unordered_map<int, V> map_;
+  std::mutex mu_;
+};
+
 class KVStoreDistServer {
  public:
   KVStoreDistServer() {
@@ -178,6 +203,9 @@ class KVStoreDistServer {
       dgt_info = dmlc::GetEnv("DGT_INFO", false);
       
 #endif
+    parallel_update_ = dmlc::GetEnv("DGT_SERVER_THREADS", 1) > 1 &&
+        dmlc::GetEnv("MXNET_KVSTORE_PARALLEL_UPDATE", false);
+    publish_ = dmlc::GetEnv("DGT_PUBLISH", false);
   }
 
   ~KVStoreDistServer() {
@@ -256,9 +284,7 @@ class KVStoreDistServer {
    * some keys are initialized before optimizer is set.
    */
   void CreateMultiPrecisionCopies() {
-    for (auto const &stored_entry : store_) {
-      const int key = stored_entry.first;
-      const NDArray &stored = stored_entry.second;
+    store_.ForEach([this](int key, const NDArray& stored) {
       if (stored.dtype() != mshadow::kFloat32) {
         auto &stored_realt = store_realt_[key];
         if (stored.storage_type() == kRowSparseStorage) {
@@ -284,9 +310,14 @@ class KVStoreDistServer {
 
         CopyFromTo(stored, stored_realt);
       }
-    }
-    for (auto const &stored_realt_entry : store_realt_) {
-      stored_realt_entry.second.WaitToRead();
+    });
+    // wait outside the lock of the map, the key threads go on meanwhile
+    std::vector<NDArray> realt;
+    store_realt_.ForEach([&realt](int key, const NDArray& stored_realt) {
+      realt.push_back(stored_realt);
+    });
+    for (const NDArray& stored_realt : realt) {
+      stored_realt.WaitToRead();
     }
   }
 
@@ -351,11 +382,82 @@ class KVStoreDistServer {
         DataHandleCompressed(type, req_meta, req_data, server);
         break;
       case RequestType::kDefaultPushPull:
-        DataHandleDefault(type, req_meta, req_data, server);
+        if (req_data.keys.size() > 1) {
+          DataHandleBatch(type, req_meta, req_data, server);
+        } else {
+          DataHandleDefault(type, req_meta, req_data, server);
+        }
         break;
     }
   }
 
+  /**
+   * \brief handle the keys a worker coalesced into one request one by one,
+   * answering the request once all of them were, see \ref Respond
+   */
+  void DataHandleBatch(const DataHandleType type, const ps::KVMeta& req_meta,
+                       const ps::KVPairs<char>& req_data,
+                       ps::KVServer<char>* server) {
+    const size_t n = req_data.keys.size();
+    if (req_meta.push) CHECK_EQ(req_data.lens.size(), n);
+    {
+      std::lock_guard<std::mutex> lk(batch_mu_);
+      Batch& batch = batches_[BatchId(req_meta)];
+      CHECK_EQ(batch.remaining, 0) << "request " << req_meta.timestamp << " of "
+                                   << req_meta.sender << " handled twice";
+      batch.remaining = n;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < n; ++i) {
+      ps::KVPairs<char> one;
+      one.keys = req_data.keys.segment(i, i + 1);
+      if (req_meta.push) {
+        one.vals = req_data.vals.segment(offset, offset + req_data.lens[i]);
+        one.lens = req_data.lens.segment(i, i + 1);
+        offset += req_data.lens[i];
+      }
+      DataHandleDefault(type, req_meta, one, server);
+    }
+  }
+
+  /**
+   * \brief respond to a request, or keep the response if the request is a
+   * batch of keys until all of them responded, then send them in one message
+   */
+  void Respond(const ps::KVMeta& req, const ps::KVPairs<char>& res,
+               ps::KVServer<char>* server) {
+    ps::KVPairs<char> all;
+    {
+      std::lock_guard<std::mutex> lk(batch_mu_);
+      auto it = batches_.find(BatchId(req));
+      if (it != batches_.end()) {
+        Batch& batch = it->second;
+        if (res.keys.size()) batch.responses.push_back(res);
+        if (--batch.remaining > 0) return;
+        std::sort(batch.responses.begin(), batch.responses.end(),
+                  [](const ps::KVPairs<char>& a, const ps::KVPairs<char>& b) {
+                    return a.keys.front() < b.keys.front();
+                  });
+        size_t bytes = 0;
+        for (const auto& r : batch.responses) bytes += r.vals.size();
+        all.vals.reserve(bytes);
+        for (const auto& r : batch.responses) {
+          all.keys.append(r.keys);
+          all.vals.append(r.vals);
+          all.lens.append(r.lens);
+        }
+        batches_.erase(it);
+      } else {
+        all = res;
+      }
+    }
+    server->Response(req, all);
+  }
+
+  static uint64_t BatchId(const ps::KVMeta& req) {
+    return (static_cast<uint64_t>(req.sender) << 32) | static_cast<uint32_t>(req.timestamp);
+  }
+
   inline bool has_multi_precision_copy(const DataHandleType type) {
     return multi_precision_ && type.dtype != mshadow::kFloat32;
   }
@@ -364,14 +466,13 @@ class KVStoreDistServer {
                            const ps::KVPairs<char>& req_data, UpdateBuf *update_buf,
                            ps::KVServer<char>* server) {
     if (!sync_mode_ || update_buf->request.size() == (size_t) ps::NumWorkers()) {
-      // let the main thread to execute updater_, which is necessary for python
+      // the updater reads the values it updates, a plain copy or the
+      // multi precision copy overwrite them all
+      DetachPulls(key, updater_ && !has_multi_precision_copy(type));
       auto& stored = has_multi_precision_copy(type) ? store_realt_[key] : store_[key];
       auto& update =  sync_mode_ ? update_buf->merged : update_buf->temp_array;
       if (updater_) {
-        exec_.Exec([this, key, &update, &stored](){
-          CHECK(updater_);
-          updater_(key, update, &stored);
-        });
+        Update(key, update, &stored);
       } else {
         CHECK(sync_mode_) << "Updater needs to be set for async mode";
         // if no updater, just copy
@@ -387,8 +488,10 @@ class KVStoreDistServer {
        * Otherwise, only send the notification
        */
       bool has_pull = false;
+      bool all_pull = true;
       for (const auto& req : update_buf->request) {
         has_pull = has_pull || req.pull;
+        all_pull = all_pull && req.pull;
       }
       if (has_pull) {
         // if there is a pull request, perform WaitToRead() once before DefaultStorageResponse
@@ -403,12 +506,17 @@ class KVStoreDistServer {
       } else {
         // otherwise, send response directly
         for (const auto& req : update_buf->request) {
-          server->Response(req);
+          Respond(req, ps::KVPairs<char>(), server);
         }
         update_buf->request.clear();
         if (has_multi_precision_copy(type)) CopyFromTo(stored, store_[key]);
         stored.WaitToRead();
       }
+      // a pushpull of every worker, e.g. gluon's Trainer, already sent each the value
+      if (publish_ && sync_mode_ && !all_pull &&
+          type.requestType == RequestType::kDefaultPushPull) {
+        Publish(type, key, req_data.keys[0], server);
+      }
     } else {
       update_buf->merged.WaitToRead();
     }
@@ -631,12 +739,61 @@ class KVStoreDistServer {
     // as server returns when store_realt is ready in this case
     if (has_multi_precision_copy(type)) stored.WaitToRead();
 
-    auto len = stored.shape().Size() * mshadow::mshadow_sizeof(stored.dtype());
     response.keys = req_data.keys;
-    response.lens = {len};
-    // TODO(mli) try to remove this CopyFrom
-    response.vals.CopyFrom(static_cast<const char*>(stored.data().dptr_), len);
-    server->Response(req_meta, response);
+    response.vals = StoredVals(key);
+    response.lens = {static_cast<int>(response.vals.size())};
+    Respond(req_meta, response, server);
+  }
+
+  /**
+   * \brief the values of store_[key] themselves, not a copy. they keep the
+   * array alive until the van is done with them, and DetachPulls moves the
+   * next update to a new buffer meanwhile
+   */
+  ps::SArray<char> StoredVals(const int key) {
+    const NDArray& stored = store_[key];
+    auto len = stored.shape().Size() * mshadow::mshadow_sizeof(stored.dtype());
+    std::shared_ptr<NDArray>& pulled = pulled_[key];
+    if (!pulled || pulled->data().dptr_ != stored.data().dptr_) {
+      pulled = std::make_shared<NDArray>(stored);
+    }
+    std::shared_ptr<NDArray> snapshot = pulled;
+    ps::SArray<char> vals;
+    vals.reset(static_cast<char*>(stored.data().dptr_), len, [snapshot](char*) { });
+    return vals;
+  }
+
+  /**
+   * \brief send the value of a key to every worker once it is updated or
+   * initialized, DGT_PUBLISH. their pulls of the key complete from it
+   * \param ps_key the key the workers pull it with
+   */
+  void Publish(const DataHandleType type, const int key, ps::Key ps_key,
+               ps::KVServer<char>* server) {
+    const NDArray& stored = store_[key];
+    if (has_multi_precision_copy(type)) stored.WaitToRead();
+    ps::KVPairs<char> kv;
+    kv.keys = {ps_key};
+    kv.vals = StoredVals(key);
+    kv.lens = {static_cast<int>(kv.vals.size())};
+    server->Publish(kv, GetCommandType(RequestType::kDefaultPushPull, type.dtype));
+  }
+
+  /**
+   * \brief give store_[key] a buffer of its own before it is written if pull
+   * responses still send the current one, keeping its values if \a copy
+   */
+  void DetachPulls(const int key, bool copy) {
+    std::shared_ptr<NDArray>& pulled = pulled_[key];
+    // only the thread of the key makes new references, the van threads
+    // dropping theirs meanwhile at worst costs a needless copy
+    if (pulled && pulled.use_count() > 1) {
+      NDArray& stored = store_[key];
+      NDArray fresh(stored.shape(), stored.ctx(), false, stored.dtype());
+      if (copy) CopyFromTo(stored, &fresh);
+      stored = fresh;
+    }
+    pulled.reset();
   }
 
   void DataHandleCompressed(const DataHandleType type,
@@ -693,10 +850,8 @@ class KVStoreDistServer {
       } else {
         // async push
         gradient_compression_->Dequantize(recved, &decomp_buf, 0);
-        exec_.Exec([this, key, &decomp_buf, &stored]() {
-          CHECK(updater_);
-          updater_(key, decomp_buf, &stored);
-        });
+        DetachPulls(key, true);
+        Update(key, decomp_buf, &stored);
         server->Response(req_meta);
         stored.WaitToRead();
       }
@@ -735,7 +890,7 @@ class KVStoreDistServer {
         stored = NDArray(dshape, Context(), false,
                          has_multi_precision_copy(type) ? mshadow::kFloat32 : type.dtype);
         CopyFromTo(recved, &stored, 0);
-        server->Response(req_meta);
+        Respond(req_meta, ps::KVPairs<char>(), server);
         if (has_multi_precision_copy(type)) {
           auto& stored_dtype = store_[key];
           stored_dtype = NDArray(dshape, Context(), false, type.dtype);
@@ -743,6 +898,7 @@ class KVStoreDistServer {
           stored_dtype.WaitToRead();
         }
         stored.WaitToRead();
+        if (publish_ && sync_mode_) Publish(type, key, req_data.keys[0], server);
       } else {
         auto &updates = update_buf_[key];
         if (sync_mode_ && updates.merged.is_none()) {
@@ -779,6 +935,22 @@ class KVStoreDistServer {
     }
   }
 
+  /**
+   * \brief run updater_ on a key, in the main thread unless the keys are
+   * updated in parallel
+   */
+  void Update(int key, const NDArray& recved, NDArray* stored) {
+    CHECK(updater_);
+    if (parallel_update_) {
+      updater_(key, recved, stored);
+    } else {
+      // let the main thread to execute updater_, which is necessary for python
+      exec_.Exec([this, key, &recved, stored]() {
+          updater_(key, recved, stored);
+        });
+    }
+  }
+
   int DecodeKey(ps::Key key) {
     auto kr = ps::Postoffice::Get()->GetServerKeyRanges()[ps::MyRank()];
     return key - kr.begin();
@@ -795,15 +967,30 @@ class KVStoreDistServer {
   /**
    * \brief store_ contains the value at kvstore for each key
    */
-  std::unordered_map<int, NDArray> store_;
-  std::unordered_map<int, NDArray> store_realt_;
+  KeyMap<NDArray> store_;
+  KeyMap<NDArray> store_realt_;
+  /**
+   * \brief the store_ entries pull responses were sent from, still in use
+   * while the van holds more references than this one
+   */
+  KeyMap<std::shared_ptr<NDArray>> pulled_;
+
+  /** \brief a request of several keys, see \ref DataHandleBatch */
+  struct Batch {
+    /** keys not responded yet */
+    size_t remaining = 0;
+    std::vector<ps::KVPairs<char>> responses;
+  };
+  /** \brief (sender << 32 | timestamp) -> the batch */
+  std::unordered_map<uint64_t, Batch> batches_;
+  std::mutex batch_mu_;
 
   /**
    * \brief merge_buf_ is a buffer used if sync_mode is true. It represents
    * values from different workers being merged. The store will be updated
    * to this value when values from all workers are pushed into this buffer.
    */
-  std::unordered_map<int, UpdateBuf> update_buf_;
+  KeyMap<UpdateBuf> update_buf_;
 #ifdef FINE_GRAIN_MSG
         bool enable_dgt  = 0;
         bool dgt_info = 0;
@@ -815,9 +1002,18 @@ class KVStoreDistServer {
    * \brief decomp_buf_ is a buffer into which compressed values are
    * decompressed before merging to the store. used when compress_!='none'
    */
-  std::unordered_map<int, NDArray> decomp_buf_;
+  KeyMap<NDArray> decomp_buf_;
 
   Executor exec_;
+  /**
+   * \brief whether the ps-lite threads of the keys (DGT_SERVER_THREADS > 1)
+   * run updater_ themselves instead of the main thread, opted in with
+   * MXNET_KVSTORE_PARALLEL_UPDATE. only for a C++ updater callable from any
+   * thread for different keys at once, never a python one
+   */
+  bool parallel_update_ = false;
+  /** \brief publish every key once updated, sparing the workers their pulls */
+  bool publish_ = false;
   ps::KVServer<char>* ps_server_;
 
   // whether to LOG verbose information